@@ -15,6 +15,22 @@
 
 #include "Deferal.h"
 #include <limits.h>
+#if defined(__AVR__)
+#include <avr/sleep.h>
+#elif defined(__unix__)
+#include <time.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+#if defined(__linux__) && defined(DEFERAL_TIMERFD)
+#include <sys/timerfd.h>
+#include <unistd.h>
+#endif
 
 #ifdef UNIT_TESTING
 #define INTEGER int
@@ -29,11 +45,11 @@
  * advantage of being explicit.
  */
 INTEGER
-ulo_cmp(unsigned long x, unsigned long y)
+ulo_cmp(deferal_tick_t x, deferal_tick_t y)
 {
-    unsigned long diff = x - y;
+    deferal_tick_t diff = x - y;
     if (diff) {
-	if (diff > (ULONG_MAX >> 1)) {
+	if (diff > (DEFERAL_TICK_MAX >> 1)) {
 	    return -1;
 	}
 	return 1;
@@ -41,423 +57,1527 @@ ulo_cmp(unsigned long x, unsigned long y)
     return 0;
 }
 
+#define WHEEL_MASK (DEFERAL_WHEEL_SLOTS - 1)
+#define WHEEL_ALL_SLOTS ((deferal_slotmap_t) ~(deferal_slotmap_t) 0)
+#define WHEEL_TOP_LEVEL ((int) DEFERAL_WHEEL_LEVELS - 1)
+
+/**
+ * @brief Return the slot index for tick at the given level of a
+ * DeferalWheel.
+ */
+static inline unsigned
+wheelIndex(deferal_tick_t tick, int level)
+{
+    return (tick >> (level * DEFERAL_WHEEL_BITS)) & WHEEL_MASK;
+}
+
+/**
+ * @brief Return a mask of the bits of a tick below those that
+ * identify a slot at the given level of a DeferalWheel.
+ */
+static inline deferal_tick_t
+wheelLowBits(int level)
+{
+    return (deferal_tick_t) ((1UL << (level * DEFERAL_WHEEL_BITS)) - 1);
+}
+
+/**
+ * @var DeferalWheel::in_tick_
+ * @brief Whether we are between calls to beginTick() and endTick().
+ * With DEFERAL_THREADS, this is kept for each thread.
+ */
+DEFERAL_THREAD_LOCAL bool DeferalWheel::in_tick_ = false;
+
 /**
- * @var Deferal::deferal_list_
- * @brief The head of a list of currently running Deferal objects.  
+ * @var DeferalWheel::current_tick_
+ * @brief The generation number of the current tick.
  *
- * This is scanned by the checkDeferred() function.  The next item in
- * the list is given by the \link Deferal::next_ next_ \endlink member
- * of the Deferal object.
+ * Each DeferalWheel records the tick in which it last read its timer
+ * function, so a new tick invalidates every wheel's snapshot of the
+ * current time at once.
  */
-Deferal *Deferal::deferal_list_ = NULL;
+DEFERAL_THREAD_LOCAL unsigned long DeferalWheel::current_tick_ = 0;
 
+/**
+ * @var TimerFnClock::millis_wheel_
+ * @brief The timing wheel for all Deferal objects that use millis()
+ * as their timer function.
+ *
+ * This is constant-initialised so that Deferals declared statically
+ * may safely be started from their constructors.
+ */
+DeferalWheel TimerFnClock::millis_wheel_(millis);
 
 /**
- * @brief Create a new, possibly running, Deferal object.
+ * @var TimerFnClock::wheels_
+ * @brief The list of timing wheels, one for each timer function in
+ * use, linked by DeferalWheel::next_.
  *
- * Note that the Deferal for each newly started or restarted delay
- * gets added to our #deferal_list_ list.
+ * The list always starts with #millis_wheel_.  Wheels for other timer
+ * functions are allocated by wheelFor() when first needed, and are
+ * never freed.
+ */
+DeferalWheel *TimerFnClock::wheels_ = &TimerFnClock::millis_wheel_;
+
+#ifdef DEFERAL_THREADS
+/**
+ * @brief Serialises the creation of wheels by wheelFor(), so that
+ * Deferals with new timer functions may be created in any thread.
+ */
+static std::mutex wheels_lock;
+#endif
+
+/**
+ * @var DeferalBase::wake_requested_
+ * @brief Whether wake() has been called since idleUntilNext() last
+ * returned.
+ */
+volatile bool DeferalBase::wake_requested_ = false;
+
+#ifdef DEFERAL_THREADS
+/**
+ * @var DeferalBase::executor_
+ * @brief The executor that runs post Deferal functions, or NULL if
+ * the poller runs them.
+ */
+DeferalExecutor *DeferalBase::executor_ = NULL;
+#endif
+
+template class BasicDeferal<TimerFnClock>;
+
+/**
+ * @brief Return the current time from our timer function.
  *
- * @param delay  The delay for our deferred operation, based on the
- * units of timer_fn().  This will be the number of milliseconds from
- * now.
- * @param autorepeat  Whether the deferal automatically restarts after
- * it expires.
- * @param start  Whether to start the delay immediately.
- * @param timer_fn  The function to be called to get the current time,
- * in suitable units.  This defaults to millis()
+ * Within a tick (see beginTick()), the timer function is
+ * read only the first time that it is needed, and that value is
+ * returned for the rest of the tick.  A wheel with no timer function
+ * is a DeferalCounter, whose time is its count.
  */
-Deferal::Deferal(unsigned long delay, bool autorepeat,
-		 bool start, TimerFn timer_fn)
+deferal_tick_t
+DeferalWheel::now()
 {
-    init(delay, autorepeat, start, timer_fn);
+    if (!clock_) {
+	return time_;
+    }
+    if (in_tick_) {
+	if (tick_ != current_tick_) {
+	    tick_ = current_tick_;
+	    time_ = clock_();
+	}
+	return time_;
+    }
+    return clock_();
 }
 
 /**
- * @brief Create a new, possibly running, Deferal object, with a
- * function to be called asynchronously when the delay has expired.
+ * @brief Start a new tick, during which time stands still for every
+ * wheel.
+ */
+void
+DeferalWheel::beginTick()
+{
+    in_tick_ = true;
+    current_tick_++;
+}
+
+/**
+ * @brief End the current tick.
+ */
+void
+DeferalWheel::endTick()
+{
+    in_tick_ = false;
+}
+
+/**
+ * @brief Advance the count by n, expiring every Deferal bound to
+ * this counter whose delay has now been reached.
  *
- * Note that the Deferal for each newly started or restarted delay
- * gets added to our #deferal_list_ list.
+ * Expired Deferals are stopped, and their post Deferal functions
+ * run, as by Deferal::drainExpired().  Only the Deferals that expire
+ * are visited, so the cost does not depend on the number of
+ * Deferals bound to the counter.
  *
- * @param delay  The delay for our deferred operation, based on the
- * units of timer_fn().  By default, this will be the number of
- * milliseconds from now.
- * @param fn  The function to be called on completion of our delay.
- * @param param  A parameter to be passed to the above function on
- * completion of our delay.
- * @param autorepeat  Whether the deferal automatically restarts after
- * it expires.
- * @param start  Whether the deferal is to be automatically started.
- * @param timer_fn  The function to be called to get the current time,
- * in suitable units.  This defaults to millis()
+ * @param n  The amount by which to advance the count.
+ * @param fn  If not NULL, a function to be called with each expired
+ * Deferal, after it has been stopped.
+ * @param param  A parameter to be passed to fn.
+ * @result The number of Deferals expired.
  */
-Deferal::Deferal(unsigned long delay, PostDeferalFn fn,
-		 void *param, bool autorepeat,
-		 bool start, TimerFn timer_fn)
+int
+DeferalCounter::advance(unsigned long n, DeferalVisitorFn fn, void *param)
 {
-    init(delay, autorepeat, start, timer_fn);
-    defer_fn_ = fn;
-    defer_fn_param_ = param;
+    time_ += n;
+    return Deferal::drain(this, fn, param);
 }
 
+#ifdef DEFERAL_THREADS
 /**
- * @brief Do the donkey-work of setting up a new Deferal for constructors.
+ * @brief Check whether any Deferal in the shard has expired, as
+ * Deferal::checkDeferals() does for the dispatcher's wheels.
+ *
+ * This must only be called by the thread that owns the shard.
+ *
+ * @result An expired Deferal, or NULL.
+ */
+Deferal *
+DeferalShard::checkDeferals()
+{
+    return Deferal::expireNext(this);
+}
+
+/**
+ * @brief Expire every Deferal in the shard that is due, as
+ * Deferal::drainExpired() does for the dispatcher's wheels.
+ *
+ * This must only be called by the thread that owns the shard.
+ *
+ * @param fn  If not NULL, a function to be called with each expired
+ * Deferal, after it has been stopped.
+ * @param param  A parameter to be passed to fn.
+ * @result The number of Deferals expired.
+ */
+int
+DeferalShard::drainExpired(DeferalVisitorFn fn, void *param)
+{
+    bool own_tick = !inTick();
+
+    if (own_tick) {
+	beginTick();
+    }
+    int count = Deferal::drain(this, fn, param);
+    if (own_tick) {
+	endTick();
+    }
+    return count;
+}
+#endif
+
+/**
+ * @brief Add a running Deferal to the wheel.
+ *
+ * If the wheel was empty, the wheel is first moved to the current
+ * time, so that it never has to catch up over a long idle period.
+ *
+ * @param entry The Deferal to be added.  This must not currently be
+ * in any list.
  */
 void
-Deferal::init(unsigned long delay, bool autorepeat,
-	      bool start, TimerFn timer_fn)
+DeferalWheel::insert(DeferalBase *entry)
 {
-    timer_fn_ = timer_fn;
-    delay_time_ = delay;
-    remaining_time_ = 0;
-    start_time_ = timer_fn();
-    defer_fn_ = NULL;
-    defer_fn_param_ = NULL;
-    next_ = NULL;
-    autorepeat_ = autorepeat;
-    if (start) {
-	start_time_ = timer_fn();
-	addDeferalEntry(this);
-	status_ = DEFERAL_RUNNING;
+    if (!count_) {
+	base_ = now();
     }
-    else {
-	status_ = DEFERAL_STOPPED;
+    count_++;
+    place(entry);
+}
+
+/**
+ * @brief Remove a Deferal from the wheel.
+ *
+ * If this empties its slot, the occupied bit for the slot is
+ * cleared, so that polls never have to visit the slot.
+ *
+ * @param entry The Deferal to be removed.  This must currently be in
+ * the wheel.
+ */
+void
+DeferalWheel::remove(DeferalBase *entry)
+{
+    DeferalBase **bucket = entry->bucket_;
+    count_--;
+    DeferalBase::unlinkEntry(entry);
+    if (!*bucket && (bucket != &due_) && (bucket != &draining_)) {
+	unsigned long slot = bucket - &slots_[0][0];
+	occupied_[slot / DEFERAL_WHEEL_SLOTS] &=
+	    ~((deferal_slotmap_t) 1 << (slot % DEFERAL_WHEEL_SLOTS));
     }
 }
 
 /**
- * @brief Ensure this Deferal is removed from Deferal#deferal_list_ on
- * destruction. 
+ * @brief Return whether a restarted Deferal may be left where it is
+ * in the wheel, rather than being placed again.
+ *
+ * This is so if the Deferal is in a slot, rather than on the due or
+ * draining list, and its new expiry time is no earlier than that for
+ * which it was placed.  Its slot then comes due no later than the
+ * Deferal, and advanceTo() places it again at that point.
+ *
+ * @param entry The restarted Deferal.
+ * @param placed The time for which the Deferal was placed, or any
+ * earlier time.
  */
-Deferal::~Deferal()
+bool
+DeferalWheel::keep(DeferalBase *entry, deferal_tick_t placed)
 {
-    removeDeferalEntry(this);
+    DeferalBase **bucket = entry->bucket_;
+    return bucket && (bucket != &due_) && (bucket != &draining_) &&
+	(ulo_cmp(entry->wheelTime(), placed) >= 0);
 }
 
 /**
- * @brief Check whether any deferals have expired.
- * @result An expired Deferal, if one has expired since the last call,
- * else NULL.
+ * @brief Advance the wheel to the current time and return the
+ * first Deferal on the due list.
+ *
+ * If the wheel is empty, the timer function is not read.
+ *
+ * @result The earliest expired Deferal, or NULL if there is none.
  */
-Deferal *
-Deferal::checkDeferals()
+DeferalBase *
+DeferalWheel::expire()
+{
+    if (!count_) {
+	return NULL;
+    }
+    advanceTo(now());
+    return due_;
+}
+
+/**
+ * @brief Return the first Deferal on the draining list, first
+ * moving the whole of the due list onto it if it is empty.
+ *
+ * Draining Deferals remain in the wheel, so they may be stopped or
+ * restarted, by post Deferal functions or otherwise, in constant
+ * time.  This does not advance the wheel, so expire() should be
+ * called first.
+ *
+ * @result The next Deferal to be drained, or NULL if there is none.
+ */
+DeferalBase *
+DeferalWheel::collect()
 {
-    Deferal *entry = deferal_list_;
-    while (entry) {
-	if (entry->expired()) {
-	    /* The stop() method will have removed entry from
-	     * deferal_list_, so we don't need to. */
-	    entry->stop(true, true);
-	    return entry;
+    if (!draining_) {
+	while (DeferalBase *entry = due_) {
+	    DeferalBase::unlinkEntry(entry);
+	    DeferalBase::linkEntry(&draining_, entry);
 	}
-	entry = entry->next_;
     }
-    return NULL;
+    return draining_;
+}
+
+/**
+ * @brief Return the running Deferal in the wheel with the earliest
+ * expiry time.
+ *
+ * Expired Deferals on the draining and due lists come first.  Otherwise, since
+ * every Deferal at a given level of the wheel expires after all of
+ * those at lower levels, only the first slot at the lowest occupied
+ * level containing a running Deferal needs to be examined.
+ *
+ * A lazily restarted Deferal (see BasicDeferal::start()) may have
+ * been left in a slot well before its expiry time.  If one is found,
+ * it is placed again and, if that moves it, the search is repeated.
+ *
+ * @result The earliest expiring Deferal, or NULL if there is none.
+ */
+DeferalBase *
+DeferalWheel::earliest()
+{
+    DeferalBase *best = DeferalBase::earliestEntry(draining_);
+    if (!best) {
+	best = DeferalBase::earliestEntry(due_);
+    }
+    while (!best) {
+	for (int level = 0; !best && (level < (int) DEFERAL_WHEEL_LEVELS);
+	     level++) {
+	    deferal_slotmap_t later = laterSlots(level);
+	    deferal_slotmap_t map = occupied_[level] & later;
+	    deferal_slotmap_t wrapped = (level == WHEEL_TOP_LEVEL)?
+		occupied_[level] & ~later: 0;
+
+	    while (!best && (map || wrapped)) {
+		if (!map) {
+		    map = wrapped;
+		    wrapped = 0;
+		}
+		int idx = __builtin_ctzll((unsigned long long) map);
+		map &= map - 1;
+		best = DeferalBase::earliestEntry(slots_[level][idx]);
+	    }
+	}
+	if (!best || !best->lazy_) {
+	    break;
+	}
+	DeferalBase **bucket = best->bucket_;
+	remove(best);
+	count_++;
+	place(best);
+	if (best->bucket_ != bucket) {
+	    best = NULL;
+	}
+    }
+    return best;
+}
+
+/**
+ * @brief Empty the wheel.
+ *
+ * Deferals in the wheel are not updated, so this is only useful for
+ * unit testing.
+ */
+void
+DeferalWheel::clear()
+{
+    base_ = 0;
+    count_ = 0;
+    due_ = NULL;
+    draining_ = NULL;
+    for (int level = 0; level < (int) DEFERAL_WHEEL_LEVELS; level++) {
+	occupied_[level] = 0;
+	for (int idx = 0; idx < DEFERAL_WHEEL_SLOTS; idx++) {
+	    slots_[level][idx] = NULL;
+	}
+    }
+}
+
+/**
+ * @brief Place a Deferal into the appropriate slot of the wheel.
+ *
+ * A Deferal goes into the lowest level at which its expiry time
+ * shares all higher-order bits with #base_.  This means that every
+ * Deferal at a given level expires after all Deferals at lower
+ * levels, and that the Deferals in a slot need only be considered
+ * once the wheel has advanced into that slot's range.  A Deferal
+ * whose expiry time has already been passed goes straight onto the
+ * due list.
+ */
+void
+DeferalWheel::place(DeferalBase *entry)
+{
+    deferal_tick_t expiry = entry->wheelTime();
+    if (ulo_cmp(expiry, base_) < 0) {
+	DeferalBase::linkEntry(&due_, entry);
+	return;
+    }
     
+    deferal_tick_t diff = expiry ^ base_;
+    int level = 0;
+    while ((level < WHEEL_TOP_LEVEL) &&
+	   (diff >> ((level + 1) * DEFERAL_WHEEL_BITS))) {
+	level++;
+    }
+    unsigned idx = wheelIndex(expiry, level);
+    DeferalBase::linkEntry(&slots_[level][idx], entry);
+    occupied_[level] |= (deferal_slotmap_t) 1 << idx;
 }
+
 /**
- * @brief Add a Deferal object to our #deferal_list_.
+ * @brief Return a mask of the slots at a given level of the wheel
+ * that lie ahead of #base_.
  *
- * Adds the Deferal to the end of the list.  If #entry is already in
- * #deferal_list_, it does nothing.
+ * At level 0 the slot for #base_ itself may be occupied.  At higher
+ * levels only slots after that for #base_ may be occupied, except at
+ * the top level where slot indexes wrap around along with the timer
+ * function.
+ */
+deferal_slotmap_t
+DeferalWheel::laterSlots(int level)
+{
+    unsigned cur = wheelIndex(base_, level);
+    return (level == 0)?
+	(deferal_slotmap_t) (WHEEL_ALL_SLOTS << cur):
+	(deferal_slotmap_t) ((WHEEL_ALL_SLOTS << cur) << 1);
+}
+
+/**
+ * @brief Find the first occupied slot at a given level of the wheel.
+ *
+ * @result The slot index, or -1 if there are no occupied slots.
+ */
+int
+DeferalWheel::firstSlot(int level)
+{
+    deferal_slotmap_t map = occupied_[level] & laterSlots(level);
+    if ((level == WHEEL_TOP_LEVEL) && !map) {
+	map = occupied_[level];
+    }
+    if (!map) {
+	return -1;
+    }
+    return __builtin_ctzll((unsigned long long) map);
+}
+
+/**
+ * @brief Move every Deferal whose expiry time is no later than now
+ * onto the due list.
  *
- * @param entry The new Deferal, to be added to #deferal_list_
+ * Rather than stepping through each tick, this jumps directly to the
+ * next occupied slot, so the cost is proportional to the number of
+ * slots visited rather than the time elapsed.
  */
 void
-Deferal::addDeferalEntry(Deferal *entry)
+DeferalWheel::advanceTo(deferal_tick_t now)
 {
-    if (deferal_list_) {
-	Deferal *deferal = deferal_list_;
-	if (deferal == entry) {
+    while (ulo_cmp(base_, now) <= 0) {
+	int level;
+	int idx = -1;
+	for (level = 0; level < (int) DEFERAL_WHEEL_LEVELS; level++) {
+	    if ((idx = firstSlot(level)) >= 0) {
+		break;
+	    }
+	}
+	if (idx < 0) {
+	    moveTo(now + 1);
+	    return;
+	}
+
+	deferal_tick_t tick = (deferal_tick_t) idx << (level * DEFERAL_WHEEL_BITS);
+	if (level < WHEEL_TOP_LEVEL) {
+	    tick |= base_ & ~wheelLowBits(level + 1);
+	}
+	if (ulo_cmp(tick, now) > 0) {
+	    moveTo(now + 1);
 	    return;
 	}
-	while (deferal->next_) {
-	    deferal = deferal->next_;
+	if (level == 0) {
+	    while (DeferalBase *entry = slots_[0][idx]) {
+		DeferalBase::unlinkEntry(entry);
+		if (entry->lazy_ && (ulo_cmp(entry->wheelTime(), tick) > 0)) {
+		    // Restarted since it was placed.
+		    place(entry);
+		}
+		else {
+		    DeferalBase::linkEntry(&due_, entry);
+		}
+	    }
+	    occupied_[0] &= ~((deferal_slotmap_t) 1 << idx);
+	    moveTo(tick + 1);
+	}
+	else {
+	    moveTo(tick);
 	}
-	deferal->next_ = entry;
     }
-    else {
-	deferal_list_ = entry;
+}
+
+/**
+ * @brief Set #base_ to tick, cascading the contents of any higher
+ * level slots whose range starts at tick.
+ */
+void
+DeferalWheel::moveTo(deferal_tick_t tick)
+{
+    base_ = tick;
+    for (int level = WHEEL_TOP_LEVEL; level > 0; level--) {
+	if (!(tick & wheelLowBits(level))) {
+	    cascade(level, wheelIndex(tick, level));
+	}
+    }
+}
+
+/**
+ * @brief Redistribute the Deferals from a slot into lower levels of
+ * the wheel.
+ */
+void
+DeferalWheel::cascade(int level, unsigned idx)
+{
+    while (DeferalBase *entry = slots_[level][idx]) {
+	DeferalBase::unlinkEntry(entry);
+	place(entry);
+    }
+    occupied_[level] &= ~((deferal_slotmap_t) 1 << idx);
+}
+
+/**
+ * @brief Return the timing wheel for a timer function, creating it
+ * if necessary.
+ *
+ * Each timer function has its own wheel, with its own snapshot of
+ * the current time, so that Deferals using an expensive timer
+ * function do not slow down those using a cheap one.
+ *
+ * New wheels are only ever appended to the list, so that, with
+ * DEFERAL_THREADS, the dispatcher may walk it while another thread
+ * adds to it.
+ */
+DeferalWheel *
+TimerFnClock::wheelFor(TimerFn timer_fn)
+{
+#ifdef DEFERAL_THREADS
+    std::lock_guard<std::mutex> guard(wheels_lock);
+#endif
+    DeferalWheel *wheel = wheels_;
+    while (wheel->clock_ != timer_fn) {
+	if (!wheel->next_) {
+	    wheel->next_ = new DeferalWheel(timer_fn);
+	}
+	wheel = wheel->next_;
+    }
+    return wheel;
+}
+
+/**
+ * @brief Return the time at which the wheel should report the
+ * Deferal as expired.
+ *
+ * This is the time within [expiry time, expiry time + slack] with
+ * the most trailing zero bits, found by clearing the low bits of the
+ * end of the window for as long as the result stays in the window.
+ */
+deferal_tick_t
+DeferalBase::wheelTime()
+{
+    deferal_tick_t expiry = expiryTime();
+    deferal_tick_t time = expiry + slack_;
+
+    if (!slack_) {
+	return expiry;
     }
 
+    for (deferal_tick_t bit = 1; bit; bit <<= 1) {
+	deferal_tick_t lower = time & ~bit;
+	if ((deferal_tick_t) (lower - expiry) > slack_) {
+	    break;
+	}
+	time = lower;
+    }
+    return time;
 }
 
 /**
- * @brief Remove a Deferal object from our #deferal_list_.
- * @param to_remove The Deferal to be removed from #deferal_list_
+ * @brief Append a Deferal to the circular list headed by bucket.
  */
 void
-Deferal::removeDeferalEntry(Deferal *to_remove)
+DeferalBase::linkEntry(DeferalBase **bucket, DeferalBase *entry)
 {
-    Deferal **p_entry = &deferal_list_;
-    while (*p_entry) {
-	if (*p_entry == to_remove) {
-	    *p_entry = to_remove->next_;
-	    to_remove->next_ = NULL;
-	    return;
+    DeferalBase *head = *bucket;
+    if (head) {
+	entry->prev_ = head->prev_;
+	entry->next_ = head;
+	head->prev_->next_ = entry;
+	head->prev_ = entry;
+    }
+    else {
+	*bucket = entry;
+	entry->next_ = entry;
+	entry->prev_ = entry;
+    }
+    entry->bucket_ = bucket;
+}
+
+/**
+ * @brief Remove a Deferal from whatever circular list it is in.
+ */
+void
+DeferalBase::unlinkEntry(DeferalBase *entry)
+{
+    DeferalBase **bucket = entry->bucket_;
+    if (bucket) {
+	if (entry->next_ == entry) {
+	    *bucket = NULL;
+	}
+	else {
+	    entry->prev_->next_ = entry->next_;
+	    entry->next_->prev_ = entry->prev_;
+	    if (*bucket == entry) {
+		*bucket = entry->next_;
+	    }
 	}
-	p_entry = &((*p_entry)->next_);
+	entry->next_ = NULL;
+	entry->prev_ = NULL;
+	entry->bucket_ = NULL;
     }
 }
 
 /**
- * @brief Start a new delay from now.
- * @param delay Optionally set a new delay period.
+ * @brief Take over the state of another Deferal, including its place
+ * in whatever circular list it is in, leaving it stopped and in no
+ * list.
+ *
+ * This is the work of the BasicDeferal move constructor and move
+ * assignment.  This must not be in any list itself.
  */
 void
-Deferal::start(unsigned long delay) {
-    if (delay) {
-	delay_time_ = delay;
+DeferalBase::moveFrom(DeferalBase &other)
+{
+    defer_fn_ = other.defer_fn_;
+    defer_fn_param_ = other.defer_fn_param_;
+#if DEFERAL_FN_SIZE > 0
+    memcpy(fn_storage_, other.fn_storage_, DEFERAL_FN_SIZE);
+    if (defer_fn_param_ == other.fn_storage_) {
+	defer_fn_param_ = fn_storage_;
+    }
+#endif
+#ifdef DEFERAL_STATS
+    stats_ = other.stats_;
+#endif
+#ifdef DEFERAL_THREADS
+    async_cmd_ = 0;
+    async_next_ = NULL;
+    async_queued_ = false;
+    exec_serial_ = other.exec_serial_;
+    exec_pending_ = 0;
+#endif
+    start_time_ = other.start_time_;
+    delay_time_ = other.delay_time_;
+    status_ = other.status_;
+    autorepeat_ = other.autorepeat_;
+    lazy_ = other.lazy_;
+    catchup_ = other.catchup_;
+    burst_ = other.burst_;
+    missed_ = other.missed_;
+    slack_ = other.slack_;
+
+    next_ = other.next_;
+    prev_ = other.prev_;
+    bucket_ = other.bucket_;
+    if (bucket_) {
+	if (next_ == &other) {
+	    next_ = this;
+	    prev_ = this;
+	}
+	else {
+	    prev_->next_ = this;
+	    next_->prev_ = this;
+	}
+	if (*bucket_ == &other) {
+	    *bucket_ = this;
+	}
     }
-    start_time_ = timer_fn_();
-    if (status_ != DEFERAL_RUNNING) {
-	status_ = DEFERAL_RUNNING;
-	addDeferalEntry(this);
+    other.next_ = NULL;
+    other.prev_ = NULL;
+    other.bucket_ = NULL;
+    other.status_ = DEFERAL_STOPPED;
+}
+
+/**
+ * @brief Find the Deferal with the earliest expiry time in the
+ * circular list headed by head.
+ *
+ * Where expiry times are equal, the first in the list is chosen.
+ *
+ * @param head  The head of the list.
+ */
+DeferalBase *
+DeferalBase::earliestEntry(DeferalBase *head)
+{
+    DeferalBase *best = NULL;
+    DeferalBase *entry = head;
+    if (entry) {
+	do {
+	    if (!best || (ulo_cmp(entry->wheelTime(),
+				  best->wheelTime()) < 0)) {
+		best = entry;
+	    }
+	    entry = entry->next_;
+	} while (entry != head);
     }
+    return best;
 }
 
+
+#if defined(__AVR__)
 /**
- * @brief Stop the current delay, possibly running our defer_fn_()
- * @param run_post_fn Whether to run defer_fn_()
- * @param allow_repeat Whether autorepeat should be allowed.
+ * @brief A sleep hook for idleUntilNext() that puts the CPU into
+ * idle mode until the next interrupt.
+ *
+ * The timer interrupt used by millis() wakes the CPU every
+ * millisecond or so, so the duration is not needed.
  */
 void
-Deferal::stop(bool run_post_fn, bool allow_repeat)
+deferalSleepIdle(unsigned long duration)
 {
-    if (status_ != DEFERAL_STOPPED) {
-	status_ = DEFERAL_STOPPED;
-	removeDeferalEntry(this);
-	if (run_post_fn && defer_fn_) {
-	    defer_fn_(defer_fn_param_);
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_mode();
+}
+#elif defined(__unix__)
+/**
+ * @brief A sleep hook for idleUntilNext() that sleeps for a duration
+ * in milliseconds, returning early if interrupted by a signal.
+ */
+void
+deferalSleepMillis(unsigned long duration)
+{
+    struct timespec req;
+    req.tv_sec = duration / 1000;
+    req.tv_nsec = (duration % 1000) * 1000000L;
+    nanosleep(&req, NULL);
+}
+#endif
+
+#if defined(__linux__) && defined(DEFERAL_TIMERFD)
+/**
+ * @brief Create a timerfd for the Deferals of a timer function.
+ *
+ * @param timer_fn  The timer function, defaulting to millis().
+ * @param ns_per_tick  The length of a tick of the timer function, in
+ * nanoseconds.  The default suits millis().
+ */
+DeferalTimerFd::DeferalTimerFd(TimerFn timer_fn, unsigned long ns_per_tick):
+    timer_fn_(timer_fn), ns_per_tick_(ns_per_tick),
+    armed_(false), deadline_(0)
+{
+    fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+}
+
+/**
+ * @brief Close the timerfd.
+ */
+DeferalTimerFd::~DeferalTimerFd()
+{
+    if (fd_ >= 0) {
+	close(fd_);
+    }
+}
+
+/**
+ * @brief Arm the timerfd for the earliest expiry of our Deferals, or
+ * disarm it if none are running.
+ *
+ * This should be called before each wait on fd(), as Deferals may
+ * have been started or stopped since the last call.  The timerfd is
+ * only updated if the earliest expiry has changed.
+ */
+void
+DeferalTimerFd::rearm()
+{
+    struct itimerspec spec = {};
+    unsigned long duration = Deferal::timeUntilNextExpiry(timer_fn_);
+
+    if (duration == ULONG_MAX) {
+	if (!armed_) {
+	    return;
 	}
-	if (allow_repeat && autorepeat_) {
-	    again();
+	armed_ = false;
+    }
+    else {
+	deferal_tick_t deadline = Deferal::tickTime(timer_fn_) + duration;
+	if (armed_ && duration && (deadline == deadline_)) {
+	    return;
 	}
+	armed_ = true;
+	deadline_ = deadline;
+	// A zero it_value would disarm the timer, so a Deferal that is
+	// already due is given the shortest possible wait.
+	unsigned long long ns = (unsigned long long) duration * ns_per_tick_;
+	spec.it_value.tv_sec = ns / 1000000000ULL;
+	spec.it_value.tv_nsec = duration? ns % 1000000000ULL: 1;
     }
+    timerfd_settime(fd_, 0, &spec, NULL);
 }
 
-bool
-Deferal::expired()
+/**
+ * @brief Expire every Deferal that is due, after fd() has become
+ * readable, and rearm the timerfd.
+ *
+ * @param fn  If not NULL, a function to be called with each expired
+ * Deferal, after it has been stopped.
+ * @param param  A parameter to be passed to fn.
+ * @result The number of Deferals expired.
+ */
+int
+DeferalTimerFd::dispatch(DeferalVisitorFn fn, void *param)
+{
+    uint64_t expirations;
+    if (read(fd_, &expirations, sizeof(expirations)) > 0) {
+	armed_ = false;
+    }
+    int count = Deferal::drainExpired(fn, param);
+    rearm();
+    return count;
+}
+#endif
+
+/*
+ * The expiry scan of DeferalTable compares a vector of deadlines at
+ * once where the target allows.  Each comparison gives a mask, with
+ * MASK_BITS bits for each byte of the vector, in which the bits for
+ * the most significant byte of each deadline that has been reached
+ * are set.
+ */
+#define TICK_BYTES sizeof(deferal_tick_t)
+
+#if defined(__AVX2__)
+typedef __m256i tick_vector_t;
+#define VECTOR_BYTES 32
+#define MASK_BITS 1
+#define SIGN_MASK ((uint64_t) (TICK_BYTES == 2? 0xaaaaaaaa:		\
+			       TICK_BYTES == 4? 0x88888888: 0x80808080))
+#elif defined(__SSE2__)
+typedef __m128i tick_vector_t;
+#define VECTOR_BYTES 16
+#define MASK_BITS 1
+#define SIGN_MASK ((uint64_t) (TICK_BYTES == 2? 0xaaaa:		\
+			       TICK_BYTES == 4? 0x8888: 0x8080))
+#elif defined(__ARM_NEON)
+typedef uint8x16_t tick_vector_t;
+#define VECTOR_BYTES 16
+#define MASK_BITS 4
+#define SIGN_MASK (TICK_BYTES == 2? 0xf0f0f0f0f0f0f0f0ULL:		\
+		   TICK_BYTES == 4? 0xf000f000f000f000ULL:		\
+		   0xf0000000f0000000ULL)
+#endif
+
+#ifdef VECTOR_BYTES
+/**
+ * @brief Return a vector holding a tick in each lane.
+ */
+static inline tick_vector_t
+broadcastTick(deferal_tick_t tick)
 {
-    if (status_ == DEFERAL_RUNNING) {
-	unsigned long now = timer_fn_();
-	// If (now - start_time) > MAXINT/2 then our start time is in
-	// the future.  That's a bid odd but it doesn't mean we have
-	// expired.
-	if ((now - start_time_) > (unsigned long) (-1L >> 1)) {
-	    return false;
+#if defined(__AVX2__)
+    return TICK_BYTES == 2? _mm256_set1_epi16((short) tick):
+	TICK_BYTES == 4? _mm256_set1_epi32((int) tick):
+	_mm256_set1_epi64x((long long) tick);
+#elif defined(__SSE2__)
+    return TICK_BYTES == 2? _mm_set1_epi16((short) tick):
+	TICK_BYTES == 4? _mm_set1_epi32((int) tick):
+	_mm_set1_epi64x((long long) tick);
+#else
+    return TICK_BYTES == 2? vreinterpretq_u8_u16(vdupq_n_u16(tick)):
+	TICK_BYTES == 4? vreinterpretq_u8_u32(vdupq_n_u32(tick)):
+	vreinterpretq_u8_u64(vdupq_n_u64(tick));
+#endif
+}
+
+/**
+ * @brief Compare a vector of deadlines with now, allowing for
+ * wrap-around.
+ *
+ * A deadline has been reached if now - deadline, as a signed tick, is
+ * not negative.
+ *
+ * @result The mask of the sign bytes of the deadlines that have been
+ * reached.
+ */
+static inline uint64_t
+reachedMask(const deferal_tick_t *deadlines, tick_vector_t now)
+{
+#if defined(__AVX2__)
+    __m256i deadline = _mm256_loadu_si256((const __m256i *) deadlines);
+    __m256i diff = TICK_BYTES == 2? _mm256_sub_epi16(now, deadline):
+	TICK_BYTES == 4? _mm256_sub_epi32(now, deadline):
+	_mm256_sub_epi64(now, deadline);
+    return ~(uint64_t) (uint32_t) _mm256_movemask_epi8(diff) & SIGN_MASK;
+#elif defined(__SSE2__)
+    __m128i deadline = _mm_loadu_si128((const __m128i *) deadlines);
+    __m128i diff = TICK_BYTES == 2? _mm_sub_epi16(now, deadline):
+	TICK_BYTES == 4? _mm_sub_epi32(now, deadline):
+	_mm_sub_epi64(now, deadline);
+    return ~(uint64_t) _mm_movemask_epi8(diff) & SIGN_MASK;
+#else
+    // NEON has no movemask, so each byte's sign is spread over the
+    // byte and narrowed to a nibble.
+    uint8x16_t deadline = vld1q_u8((const uint8_t *) deadlines);
+    uint8x16_t diff = TICK_BYTES == 2?
+	vreinterpretq_u8_u16(vsubq_u16(vreinterpretq_u16_u8(now),
+				       vreinterpretq_u16_u8(deadline))):
+	TICK_BYTES == 4?
+	vreinterpretq_u8_u32(vsubq_u32(vreinterpretq_u32_u8(now),
+				       vreinterpretq_u32_u8(deadline))):
+	vreinterpretq_u8_u64(vsubq_u64(vreinterpretq_u64_u8(now),
+				       vreinterpretq_u64_u8(deadline)));
+    int8x16_t signs = vshrq_n_s8(vreinterpretq_s8_u8(diff), 7);
+    uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_s8(signs), 4);
+    return ~vget_lane_u64(vreinterpret_u64_u8(nibbles), 0) & SIGN_MASK;
+#endif
+}
+#endif
+
+/**
+ * @brief Return the position of the first deadline, from position
+ * from up to count, that has been reached at time now.
+ *
+ * Deadlines are compared allowing for wrap-around, so a deadline has
+ * been reached if it is no more than half the range of a tick before
+ * now.  Where the target has SSE2, AVX2 or NEON, a vector of deadlines
+ * is compared at once.
+ *
+ * @result The position of the deadline, or count if none has been
+ * reached.
+ */
+unsigned
+deferalFindExpired(const deferal_tick_t *deadlines, unsigned from,
+		   unsigned count, deferal_tick_t now)
+{
+#ifdef VECTOR_BYTES
+    const unsigned lanes = VECTOR_BYTES / TICK_BYTES;
+    tick_vector_t now_vector = broadcastTick(now);
+
+    // Most deadlines have not been reached, so four vectors are
+    // compared before any mask is examined.
+    while (from + 4 * lanes <= count) {
+	const deferal_tick_t *next = deadlines + from;
+	if (reachedMask(next, now_vector) |
+	    reachedMask(next + lanes, now_vector) |
+	    reachedMask(next + 2 * lanes, now_vector) |
+	    reachedMask(next + 3 * lanes, now_vector)) {
+	    break;
 	}
-	return ((now - start_time_) >= delay_time_);
+	from += 4 * lanes;
     }
-    return false;
+    while (from + lanes <= count) {
+	uint64_t reached = reachedMask(deadlines + from, now_vector);
+	if (reached) {
+	    return from + __builtin_ctzll(reached) / (MASK_BITS * TICK_BYTES);
+	}
+	from += lanes;
+    }
+#endif
+    for (; from < count; from++) {
+	if ((deferal_stick_t) (deferal_tick_t) (now - deadlines[from]) >= 0) {
+	    return from;
+	}
+    }
+    return count;
 }
 
+#ifdef DEFERAL_STATS
 /**
- * @brief Check the current state of a Deferal, expiring it as needed.
- * 
- * If a Deferal has passed its completion time, it will be stopped,
- * possibly running the expiry function, and possibly automatically
- * restarting it if appropriate.
+ * @var DeferalStats::global_
+ * @brief Statistics for every Deferal.
+ */
+DeferalStats DeferalStats::global_;
+
+/**
+ * @var DeferalStats::poll_intervals_
+ * @brief The intervals between successive polls.
+ */
+DeferalHistogram DeferalStats::poll_intervals_;
+
+/**
+ * @var DeferalStats::polled_
+ * @brief Whether #last_poll_ has been set.
+ */
+bool DeferalStats::polled_ = false;
+
+/**
+ * @var DeferalStats::last_poll_
+ * @brief The value of DEFERAL_STATS_CLOCK at the last poll.
+ */
+unsigned long DeferalStats::last_poll_ = 0;
+
+/**
+ * @brief Add a value to the histogram.
  */
 void
-Deferal::updateStatus()
+DeferalHistogram::record(unsigned long value)
 {
-    if (expired()) {
-	stop(true, true);
+    int i = 0;
+    unsigned long v = value;
+    while (v && (i < DEFERAL_STATS_BUCKETS - 1)) {
+	v >>= 1;
+	i++;
+    }
+    buckets_[i]++;
+    count_++;
+    total_ += value;
+    if (value > max_) {
+	max_ = value;
     }
 }
 
 /**
- * @brief Predicate: true if the Deferal is in the stopped state.
+ * @brief Empty the histogram.
  */
-bool
-Deferal::stopped()
+void
+DeferalHistogram::clear()
 {
-    updateStatus();
-    return status_ == DEFERAL_STOPPED;
+    count_ = 0;
+    total_ = 0;
+    max_ = 0;
+    for (int i = 0; i < DEFERAL_STATS_BUCKETS; i++) {
+	buckets_[i] = 0;
+    }
 }
 
 /**
- * @brief Predicate: true if the Deferal is in the running state.
+ * @brief Reset the statistics.
  */
-bool
-Deferal::running()
+void
+DeferalStats::clear()
 {
-    updateStatus();
-    return status_ == DEFERAL_RUNNING;
+    lateness_.clear();
+    callback_time_.clear();
+    missed_ = 0;
 }
 
 /**
- * @brief Predicate: true if the Deferal is in the paused state.
+ * @brief Reset the global statistics and the poll interval histogram.
  */
-bool
-Deferal::paused()
+void
+DeferalStats::clearGlobal()
+{
+    global_.clear();
+    poll_intervals_.clear();
+    polled_ = false;
+}
+
+/**
+ * @brief Record the interval since the last poll.
+ */
+void
+DeferalStats::recordPoll()
 {
-    updateStatus();
-    return status_ == DEFERAL_PAUSED;
+    unsigned long now = DEFERAL_STATS_CLOCK();
+    if (polled_) {
+	poll_intervals_.record(now - last_poll_);
+    }
+    polled_ = true;
+    last_poll_ = now;
 }
 
 /**
- * @brief Return the status of the Deferal (running, paused, stopped).
+ * @brief Call the post Deferal function, which must not be NULL,
+ * recording how long it takes.
  */
-deferal_status_t
-Deferal::status()
+void
+DeferalBase::callDeferFn()
 {
-    updateStatus();
-    return status_;
+#ifdef DEFERAL_THREADS
+    if (executed()) {
+	// The time taken by the call is not known to us.
+	executor_->submit(exec_serial_? this: NULL,
+			  defer_fn_, defer_fn_param_);
+	return;
+    }
+#endif
+    unsigned long start = DEFERAL_STATS_CLOCK();
+    defer_fn_(defer_fn_param_);
+    unsigned long elapsed = DEFERAL_STATS_CLOCK() - start;
+
+    DeferalStats::global_.callback_time_.record(elapsed);
+    if (stats_) {
+	stats_->callback_time_.record(elapsed);
+    }
 }
 
 /**
- * @brief Pause a running deferal.
+ * @brief Record how late the expiry of a Deferal has been noticed.
  */
 void
-Deferal::pause()
+DeferalBase::recordLateness(deferal_tick_t lateness)
 {
-    updateStatus();
-    if (status_ == DEFERAL_RUNNING) {
-	unsigned long now = timer_fn_();
-	status_ = DEFERAL_PAUSED;
-	remaining_time_ = now - start_time_;
+    DeferalStats::global_.lateness_.record(lateness);
+    if (stats_) {
+	stats_->lateness_.record(lateness);
     }
 }
 
 /**
- * @brief Resume a paused deferal.
+ * @brief Record that a Deferal has missed some periods.
  */
 void
-Deferal::resume()
+DeferalBase::recordMissed(unsigned long missed)
 {
-    if (status_ == DEFERAL_PAUSED) {
-	unsigned long now = timer_fn_();
-	start_time_ = now - remaining_time_;
-	status_ = DEFERAL_RUNNING;
+    DeferalStats::global_.missed_ += missed;
+    if (stats_) {
+	stats_->missed_ += missed;
     }
 }
+#endif
 
+#ifdef DEFERAL_THREADS
 /**
- * @brief Repeat the last delay from the time of its completion.
+ * @brief Create an executor, starting its worker threads.
  *
- * If the added delay still leaves us stopped, we may run any
- * associated post Deferal function.  This only makes sense for
- * Deferals that have stopped.
+ * @param workers  The number of worker threads, at least 1.
+ */
+DeferalExecutor::DeferalExecutor(unsigned workers):
+    nworkers_(workers? workers: 1), next_(0), queued_(0),
+    outstanding_(0), sleepers_(0), stopping_(false), completed_(0),
+    inlined_(0), started_(0), total_latency_(0), max_latency_(0)
+{
+    workers_ = new Worker[nworkers_];
+    for (unsigned i = 0; i < nworkers_; i++) {
+	workers_[i].head = 0;
+	workers_[i].count = 0;
+    }
+    for (unsigned i = 0; i < nworkers_; i++) {
+	workers_[i].thread = std::thread(&DeferalExecutor::work, this, i);
+    }
+}
+
+/**
+ * @brief Wait for all outstanding calls, then stop the workers.
+ */
+DeferalExecutor::~DeferalExecutor()
+{
+    wait();
+    stopping_ = true;
+    {
+	std::lock_guard<std::mutex> guard(idle_lock_);
+	idle_.notify_all();
+    }
+    for (unsigned i = 0; i < nworkers_; i++) {
+	workers_[i].thread.join();
+    }
+    delete[] workers_;
+}
+
+/**
+ * @brief Return the time from a monotonic clock, in nanoseconds.
+ */
+uint64_t
+DeferalExecutor::nowNs()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+	std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * @brief Hand a call to the workers.
+ *
+ * This is called by the poller, in place of calling fn itself.
+ *
+ * @param serial  The Deferal whose calls are to be serialised, or
+ * NULL if the call may overlap others.  If a serialised call for the
+ * Deferal is already outstanding, this call is made by the same
+ * worker once that one returns, to the Deferal's post Deferal function
+ * as it is then.
+ * @param fn  The function to call.
+ * @param param  The parameter to be passed to fn.
  */
 void
-Deferal::again(unsigned long delay, bool run_post_fn)
+DeferalExecutor::submit(DeferalBase *serial, PostDeferalFn fn, void *param)
 {
-    if (status_ == DEFERAL_STOPPED) {
-	unsigned long now = timer_fn_();
-	unsigned long this_delay = delay? delay: delay_time_;
-    
-	// Set start_time_ to the time it would have automatically
-	// restarted, had it done so.
-	start_time_ += delay_time_;
-	delay_time_ = this_delay;
-	while ((now - start_time_) > delay_time_) {
-	    // Running again still leaves the finish time in the past
-	    if (run_post_fn && defer_fn_) {
-		status_ = DEFERAL_PROCESSING;
-		defer_fn_(defer_fn_param_);
-		status_ = DEFERAL_STOPPED;
-	    }
-	    if (!autorepeat_) {
-		// If we are to autorepeat, we'll keep running the
-		// loop until we caught up and then start ourselves
-		// running again.  If not, we are done here.
-		return;
+    Task task = {serial, fn, param, nowNs()};
+
+    outstanding_++;
+    if (serial && serial->exec_pending_.fetch_add(1)) {
+	return;
+    }
+    unsigned first = next_.load(std::memory_order_relaxed);
+    for (unsigned i = 0; i < nworkers_; i++) {
+	Worker *worker = &workers_[(first + i) % nworkers_];
+	if (push(worker, task)) {
+	    next_.store((first + i + 1) % nworkers_,
+			std::memory_order_relaxed);
+	    queued_++;
+	    if (sleepers_) {
+		std::lock_guard<std::mutex> guard(idle_lock_);
+		idle_.notify_one();
 	    }
-	    start_time_ += delay_time_;
+	    return;
 	}
-	status_ = DEFERAL_RUNNING;
-	addDeferalEntry(this);
     }
-    else {
-	start(delay);
+    inlined_++;
+    run(task);
+}
+
+/**
+ * @brief Wait until every call submitted so far has completed.
+ *
+ * This must not be called from a post Deferal function run by the
+ * executor.
+ */
+void
+DeferalExecutor::wait()
+{
+    while (outstanding_) {
+	std::this_thread::yield();
     }
 }
 
 /**
- * @brief Return the outstanding delay amount at the current time.
- * Note that this may be negative if the delay has expired and not
- * restarted. 
+ * @brief Return the mean time, in nanoseconds, that calls waited
+ * between submission and starting to run.
  */
-long
-Deferal::remaining()
+unsigned long
+DeferalExecutor::meanLatency()
 {
-    unsigned long now = timer_fn_();
-    return delay_time_ - (now - start_time_);
+    unsigned long started = started_;
+    return started? (unsigned long) (total_latency_ / started): 0;
 }
 
 /**
- * @brief Set the function to be run when the Deferal expires.
- * 
- * @param fn  The function to be called on completion of our delay.
- * @param param  A parameter to be passed to the above function on
- * completion of our delay.
+ * @brief Reset the counts of calls and their latencies.
  */
 void
-Deferal::setDeferalFn(PostDeferalFn fn, void *param)
+DeferalExecutor::clearCounts()
 {
-    defer_fn_ = fn;
-    defer_fn_param_ = param;
+    completed_ = 0;
+    inlined_ = 0;
+    started_ = 0;
+    total_latency_ = 0;
+    max_latency_ = 0;
 }
 
 /**
- * @brief Return the delay period for this Deferal.
+ * @brief Add a call to the back of a worker's queue.
+ *
+ * @result false if the queue is full.
  */
-long
-Deferal::delayPeriod()
+bool
+DeferalExecutor::push(Worker *worker, const Task &task)
 {
-    return delay_time_;
+    std::lock_guard<std::mutex> guard(worker->lock);
+    if (worker->count == DEFERAL_EXECUTOR_QUEUE) {
+	return false;
+    }
+    worker->tasks[(worker->head + worker->count) % DEFERAL_EXECUTOR_QUEUE] =
+	task;
+    worker->count++;
+    return true;
 }
 
 /**
- * @brief Set the delay period for this Deferal.
+ * @brief Remove a call from a worker's queue: from the front for the
+ * worker itself, so that calls are started in order, or from the back
+ * when stealing.
  *
- * @param delay  The delay for our deferred operation, based on the
- * units of Deferal::timer_fn_().  
+ * @result false if the queue is empty.
+ */
+bool
+DeferalExecutor::pop(Worker *worker, Task *task, bool steal)
+{
+    std::lock_guard<std::mutex> guard(worker->lock);
+    if (!worker->count) {
+	return false;
+    }
+    worker->count--;
+    if (steal) {
+	*task = worker->tasks[(worker->head + worker->count) %
+			      DEFERAL_EXECUTOR_QUEUE];
+    }
+    else {
+	*task = worker->tasks[worker->head];
+	worker->head = (worker->head + 1) % DEFERAL_EXECUTOR_QUEUE;
+    }
+    return true;
+}
+
+/**
+ * @brief Take a call for a worker, from its own queue or, failing
+ * that, from another's.
+ */
+bool
+DeferalExecutor::take(unsigned self, Task *task)
+{
+    if (pop(&workers_[self], task, false)) {
+	return true;
+    }
+    for (unsigned i = 1; i < nworkers_; i++) {
+	if (pop(&workers_[(self + i) % nworkers_], task, true)) {
+	    return true;
+	}
+    }
+    return false;
+}
+
+/**
+ * @brief Make a call, and any that were submitted for the same
+ * serialised Deferal while it ran.  Those calls are made to the
+ * Deferal's current post Deferal function, which must therefore not be
+ * changed while calls for it are outstanding.
  */
 void
-Deferal::setDelay(unsigned long delay)
+DeferalExecutor::run(const Task &task)
 {
-    delay_time_ = delay;
+    unsigned long latency = (unsigned long) (nowNs() - task.submitted);
+    unsigned long max = max_latency_;
+
+    while (latency > max && !max_latency_.compare_exchange_weak(max, latency)) {
+    }
+    total_latency_ += latency;
+    started_++;
+    task.fn(task.param);
+    while (true) {
+	// The serialised Deferal may be destroyed as soon as wait()
+	// returns, so outstanding_ is not decremented until we are done
+	// with it.
+	bool more = task.serial &&
+	    (task.serial->exec_pending_.fetch_sub(1) != 1);
+	completed_++;
+	outstanding_--;
+	if (!more) {
+	    break;
+	}
+	task.serial->defer_fn_(task.serial->defer_fn_param_);
+    }
 }
 
 /**
- * @brief Set the offset period for the first expiry of this Deferal.
- *
- * This should be set immediately after creating the Deferal or
- * setting a delay.  This allows us to start a repeating delay with
- * the first delay expiring sooner or later than the delay period.
- * This allows us, for example, to set a heartbeat interval of one
- * minute, with the first heartbeat occurring 30 seconds from now.
- *
- * @param offset  The delay for the first expiry of this Deferal 
- * in units of Deferal::timer_fn_().  
+ * @brief The body of each worker thread.
  */
 void
-Deferal::setOffset(unsigned long offset)
+DeferalExecutor::work(unsigned self)
 {
-    unsigned long expiry_time = start_time_ + delay_time_;
-    start_time_ = expiry_time - offset;
+    Task task;
+
+    while (true) {
+	if (take(self, &task)) {
+	    queued_--;
+	    run(task);
+	    continue;
+	}
+	std::unique_lock<std::mutex> guard(idle_lock_);
+	sleepers_++;
+	while (!queued_ && !stopping_) {
+	    idle_.wait(guard);
+	}
+	sleepers_--;
+	if (stopping_ && !queued_) {
+	    return;
+	}
+    }
 }
+#endif
 
+#ifdef DEFERAL_COROUTINES
+/**
+ * @var DeferalAwaiter::ready_head_
+ * @brief The first of the awaiters whose coroutines are ready to be
+ * resumed.
+ */
+DEFERAL_THREAD_LOCAL DeferalAwaiter *DeferalAwaiter::ready_head_ = NULL;
+
+/**
+ * @var DeferalAwaiter::ready_tail_
+ * @brief The last of the awaiters whose coroutines are ready to be
+ * resumed.
+ */
+DEFERAL_THREAD_LOCAL DeferalAwaiter *DeferalAwaiter::ready_tail_ = NULL;
+
+/**
+ * @brief Add this awaiter to the end of the ready list.
+ */
+void
+DeferalAwaiter::ready()
+{
+    next_ready_ = NULL;
+    if (ready_tail_) {
+	ready_tail_->next_ready_ = this;
+    }
+    else {
+	ready_head_ = this;
+    }
+    ready_tail_ = this;
+}
 
-#ifdef UNIT_TESTING
 /**
- * @brief Reset the deferal list to be empty.
+ * @brief The post Deferal function of an awaiter's Deferal.
  */
 void
-Deferal::clearDeferals()
+DeferalAwaiter::readyFn(void *awaiter)
+{
+    ((DeferalAwaiter *) awaiter)->ready();
+}
+
+/**
+ * @brief Return whether fn is the post Deferal function of an
+ * awaiter, which is always called by the polling thread.
+ */
+bool
+DeferalAwaiter::awaits(PostDeferalFn fn)
+{
+    return (fn == readyFn) || (fn == DeferalWait::waitFn);
+}
+
+/**
+ * @brief Resume the coroutines that are ready, in the order that
+ * they became ready.
+ *
+ * Coroutines that become ready again while this runs, as after
+ * waiting on a Deferal that has already expired, are left for the
+ * next call, so this always returns.
+ */
+void
+DeferalAwaiter::resumeReady()
+{
+    DeferalAwaiter *awaiter = ready_head_;
+
+    ready_head_ = NULL;
+    ready_tail_ = NULL;
+    while (awaiter) {
+	/* Resuming will usually destroy the awaiter. */
+	DeferalAwaiter *next = awaiter->next_ready_;
+	awaiter->handle_.resume();
+	awaiter = next;
+    }
+}
+
+/**
+ * @brief The post Deferal function installed on a Deferal being
+ * waited for, which restores and calls the original.
+ */
+void
+DeferalWait::waitFn(void *awaiter)
+{
+    DeferalWait *wait = (DeferalWait *) awaiter;
+
+    wait->deferal_->defer_fn_ = wait->fn_;
+    wait->deferal_->defer_fn_param_ = wait->param_;
+    if (wait->fn_) {
+	wait->fn_(wait->param_);
+    }
+    wait->ready();
+}
+
+/**
+ * @brief The pool of coroutine frames for DeferalTask.
+ */
+alignas(alignof(max_align_t))
+static unsigned char task_frames[DEFERAL_TASK_FRAMES][DEFERAL_TASK_FRAME_SIZE];
+
+/**
+ * @brief Which frames of task_frames are in use.  With
+ * DEFERAL_THREADS, coroutines on different threads may allocate and
+ * free frames at once, so each frame is claimed atomically.
+ */
+#ifdef DEFERAL_THREADS
+static std::atomic<bool> task_frame_used[DEFERAL_TASK_FRAMES];
+#else
+static bool task_frame_used[DEFERAL_TASK_FRAMES];
+#endif
+
+/**
+ * @brief Claim a frame of task_frames, if it is free.
+ */
+static inline bool
+claimFrame(int i)
 {
-    deferal_list_ = NULL;
+#ifdef DEFERAL_THREADS
+    return !task_frame_used[i].exchange(true, std::memory_order_acquire);
+#else
+    if (task_frame_used[i]) {
+	return false;
+    }
+    task_frame_used[i] = true;
+    return true;
+#endif
 }
 
+/**
+ * @brief Allocate a coroutine frame from the pool.
+ *
+ * @result The frame, or NULL if none is free or size is too big.
+ */
+void *
+DeferalTask::allocFrame(size_t size)
+{
+    if (size > DEFERAL_TASK_FRAME_SIZE) {
+	return NULL;
+    }
+    for (int i = 0; i < DEFERAL_TASK_FRAMES; i++) {
+	if (claimFrame(i)) {
+	    return task_frames[i];
+	}
+    }
+    return NULL;
+}
+
+/**
+ * @brief Return a coroutine frame to the pool.
+ */
 void
-Deferal::reset(unsigned long delay, bool autorepeat,
-	       bool start, TimerFn timer_fn)
+DeferalTask::freeFrame(void *frame)
 {
-    init(delay, autorepeat, start, timer_fn);
+    task_frame_used[((unsigned char (*)[DEFERAL_TASK_FRAME_SIZE]) frame) -
+		    task_frames] = false;
 }
-#endif    
 
+/**
+ * @brief Return the number of coroutine frames in use.
+ */
+unsigned
+DeferalTask::framesInUse()
+{
+    unsigned count = 0;
+    for (int i = 0; i < DEFERAL_TASK_FRAMES; i++) {
+	count += task_frame_used[i];
+    }
+    return count;
+}
+#endif
@@ -4,35 +4,101 @@
  *     Author:       Marc Munro
  *     Copyright (c) 2024 Marc Munro
  *     License:      GPL V3
- * 
+ *
  * \endcode
- * @brief  
+ * @brief
  * Defines the Deferal class.
- * 
+ *
  */
 
 #include <Arduino.h>
+#include <limits.h>
+#include <string.h>
+#if defined(ARDUINO)
+#include <new.h>
+#else
+#include <new>
+#endif
+#if !defined(ARDUINO) || __has_include(<type_traits>)
+#include <type_traits>
+#define DEFERAL_TRIVIAL_DTOR(T) std::is_trivially_destructible<T>::value
+#else
+// AVR cores have no standard library.
+#define DEFERAL_TRIVIAL_DTOR(T) __is_trivially_destructible(T)
+#endif
+#ifdef DEFERAL_COROUTINES
+/**
+ * @def DEFERAL_COROUTINES
+ * @brief Define to provide DeferalTask, deferalSleepFor() and
+ * co_await on a Deferal, which need C++20 coroutines.
+ */
+#if __cplusplus < 202002L || !defined(__cpp_impl_coroutine)
+#error "DEFERAL_COROUTINES needs a compiler supporting C++20 coroutines"
+#endif
+#include <coroutine>
+#include <exception>
+#endif
+#ifdef DEFERAL_THREADS
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
 
 #ifndef LIB_DEFERAL
 #define LIB_DEFERAL
 
+template <class Clock> class BasicDeferal;
+class TimerFnClock;
+class DeferalBase;
+
+/**
+ * @brief The Deferal class: a BasicDeferal whose timer function is
+ * chosen at run time.
+ */
+typedef BasicDeferal<TimerFnClock> Deferal;
+
 /**
- * @brief Function Prototype for functions called on the expiry of a deferal 
+ * @brief Function Prototype for functions called on the expiry of a deferal
  */
 typedef void (*PostDeferalFn)(void *);
 
 /**
- * @brief Function Prototype for timer functions.  
+ * @brief Function Prototype for functions called for each Deferal
+ * expired by Deferal::drainExpired().
+ */
+typedef void (*DeferalVisitorFn)(Deferal *deferal, void *param);
+
+/**
+ * @brief Function Prototype for timer functions.
  *
  * The default timer function is millis().
  */
 typedef unsigned long (*TimerFn)();
 
+/**
+ * @brief Function Prototype for sleep hooks, used by
+ * Deferal::idleUntilNext().
+ *
+ * A sleep hook should sleep for up to duration clock units, and
+ * should return early when an interrupt occurs.  A duration of
+ * ULONG_MAX means that there is nothing to wait for, so the hook may
+ * sleep until woken.
+ */
+typedef void (*DeferalSleepFn)(unsigned long duration);
+
+#if defined(__AVR__)
+extern void deferalSleepIdle(unsigned long duration);
+#elif defined(__unix__)
+extern void deferalSleepMillis(unsigned long duration);
+#endif
+
 /**
  * @brief The status of a Deferal object.
  *
- * If a Deferal is in the DEFERAL_RUNNING state, it will exist in the
- * linked list of running Deferals, Deferal#deferal_list_.
+ * A Deferal is in the timing wheel for its clock if and only if it
+ * is in the DEFERAL_RUNNING state.
  */
 typedef enum {
     DEFERAL_RUNNING = 42,
@@ -41,147 +107,3047 @@ typedef enum {
     DEFERAL_PROCESSING  // Used to prevent unwanted recursion
 } deferal_status_t;
 
+/**
+ * @brief How an autorepeating Deferal catches up on periods that it
+ * has missed, by expiring more than a whole period late.
+ *
+ * The Deferal always resumes at the next of its original periods;
+ * the policies differ only in how many times the post Deferal
+ * function is called for the missed periods.
+ */
+typedef enum {
+    DEFERAL_CATCHUP_ALL,    // Call it once for each missed period
+    DEFERAL_CATCHUP_ONCE,   // Only its expiry call, see missedPeriods()
+    DEFERAL_CATCHUP_SKIP,   // Do not call it for missed periods
+    DEFERAL_CATCHUP_BURST   // Call it for up to a given number of periods
+} deferal_catchup_t;
+
+/**
+ * @brief The largest number of calls allowed by DEFERAL_CATCHUP_BURST.
+ */
+#define DEFERAL_MAX_BURST 63
+
+/**
+ * @brief The number of commands that interrupt handlers may queue,
+ * using Deferal::startFromISR() and friends, between polls.
+ *
+ * This must be a power of 2, no greater than 128.
+ */
+#ifndef DEFERAL_ISR_RING_SIZE
+#define DEFERAL_ISR_RING_SIZE 8
+#endif
+
+#if (DEFERAL_ISR_RING_SIZE & (DEFERAL_ISR_RING_SIZE - 1)) || \
+    (DEFERAL_ISR_RING_SIZE > 128)
+#error "DEFERAL_ISR_RING_SIZE must be a power of 2, no greater than 128"
+#endif
+
+/**
+ * @brief Prevent the compiler from moving memory accesses across
+ * this point, so that an interrupt handler sees a command before the
+ * index that publishes it.
+ */
+#define DEFERAL_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+/**
+ * @brief Operations that interrupt handlers may request.
+ */
+typedef enum {
+    DEFERAL_CMD_START,
+    DEFERAL_CMD_STOP,
+    DEFERAL_CMD_AGAIN,
+    DEFERAL_CMD_RESUME    // Used by Deferal::migrate()
+} deferal_command_t;
+
+/**
+ * @brief The number of low bits of a command word from another thread
+ * that hold its deferal_command_t plus 1, the rest holding its delay.
+ */
+#define DEFERAL_CMD_BITS 3
+
+/**
+ * @def DEFERAL_THREADS
+ * @brief Define this, for host builds only, to allow other threads to
+ * start and stop Deferals using Deferal::startAsync() and friends.
+ *
+ * One thread, the dispatcher, owns the wheels: it alone may call
+ * checkDeferals(), drainExpired() and the other methods of Deferals.
+ * Other threads submit commands, without locking, which the
+ * dispatcher applies as it polls.  This needs C++11 atomics.
+ *
+ * Other threads may own wheels of their own, each a DeferalShard.
+ * Ticks (see Deferal::beginTick()) are then kept separately for each
+ * thread.  Post Deferal functions may be run by a DeferalExecutor
+ * rather than by the thread that polls.
+ */
+
+#ifdef DEFERAL_THREADS
+#define DEFERAL_THREAD_LOCAL thread_local
+#else
+#define DEFERAL_THREAD_LOCAL
+#endif
+
 
 #define ONE_SECOND_MS 1000
 
 /**
- * @class Deferal
- * @brief The Deferal class
- * 
- * A Deferal is an object for handling timeouts and other period-based
- * activities.  Deferals provide non-blocking timed operations that
- * can be single-shot or repetitive.  Multiple Deferals can run
- * simultaneously.  A Deferal may be given a callback function which
- * will be called when it expires.
+ * @brief The number of bytes in each Deferal for storing the
+ * captures of a lambda or other functor passed to
+ * Deferal::setDeferalFn().
  *
- * Deferals must be periodically checked by polling for expired
- * Deferals using Deferal::checkDeferals().  This returns the latest
- * unreported expired Deferal.  
+ * Functors no bigger than a pointer are always stored in place of
+ * the post Deferal function's parameter, so need no extra space.
+ * Larger ones need this to be defined, as a multiple of the size of
+ * a pointer.  It defaults to 0, adding nothing to a Deferal.
+ */
+#ifndef DEFERAL_FN_SIZE
+#define DEFERAL_FN_SIZE 0
+#endif
+
+/**
+ * @brief The number of bits in the times recorded by a Deferal.
  *
- * The basic operations on a Deferal are:
- *  - creation.
- *    The constructors define the delay period, whether to
- *    automatically start, the function to be used to tell the time
- *    (defaulting to millis()) and any function, with parameter, to be
- *    called when the Deferal expires.
- * 
- *  - start 
- *    start() optionally redefines the delay period.  It starts from
- *    the current time.
- * 
- *  - stop
- *    stop() stops the current deferal, optionally running the expiry
- *    function.
- *    
- *  - pause
- *    pause() stops the current deferal, recording the time remaining.
- * 
- *  - resume
- *    resume() resumes the current deferal, for the period given by the
- *    remaining time after a pause.  Resuming a stopped or running
- *    Deferal does nothing.
- * 
- *  - repeat
- *    again() runs the current deferal with the delay period set as if
- *    the Deferal had immediately restarted after completion.  Ie if
- *    the delay period is 1000, but again() was called 100 ticks after
- *    the Deferal completed, the remaining delay period will be 900.
- *    If the Deferal should have run to completion by now, it will
- *    immediately complete and call any post deferal function.
- * 
- *  - test
- *    running(), paused() stopped() and status() give the current
- *    status of a Deferal in different, obvious, ways.
- * 
- *  - modification
- *    setDeferalFn() sets the function to be run on completion of the
- *    Deferal, setDelay() updates the delay time, causing the Deferal
- *    to stop and the post Deferal function to be called if
- *    appropriate.
+ * By default times are unsigned longs, as returned by timer
+ * functions.  Defining DEFERAL_TICK_BITS as 16 or 32 makes each
+ * Deferal smaller, at the cost of limiting delays to less than half
+ * of the range of the tick type (about 32 seconds for 16 bit ticks
+ * from millis()).  Timer functions are still declared as returning
+ * unsigned long, and are truncated to the tick type.
+ */
+#if !defined(DEFERAL_TICK_BITS)
+typedef unsigned long deferal_tick_t;
+typedef long deferal_stick_t;
+#elif DEFERAL_TICK_BITS == 16
+typedef uint16_t deferal_tick_t;
+typedef int16_t deferal_stick_t;
+#elif DEFERAL_TICK_BITS == 32
+typedef uint32_t deferal_tick_t;
+typedef int32_t deferal_stick_t;
+#else
+#error "DEFERAL_TICK_BITS must be 16 or 32"
+#endif
+
+#define DEFERAL_TICK_MAX ((deferal_tick_t) ~(deferal_tick_t) 0)
+
+/**
+ * @brief The most slack a Deferal may have (see setSlack()), which
+ * keeps its window well inside half the tick range.
+ */
+#define DEFERAL_MAX_SLACK \
+    ((DEFERAL_TICK_MAX >> 2) < 0xffff? \
+     (unsigned long) (DEFERAL_TICK_MAX >> 2): 0xffffUL)
+
+/**
+ * @brief The number of bits of a tick consumed by each level of the
+ * timing wheel.
+ *
+ * Each level has (1 << DEFERAL_WHEEL_BITS) slots.  The default is
+ * kept small for AVR targets where every slot costs RAM.
+ */
+#ifndef DEFERAL_WHEEL_BITS
+#ifdef __AVR__
+#define DEFERAL_WHEEL_BITS 4
+#else
+#define DEFERAL_WHEEL_BITS 6
+#endif
+#endif
+
+#define DEFERAL_WHEEL_SLOTS (1 << DEFERAL_WHEEL_BITS)
+
+/**
+ * @brief The number of levels in the timing wheel.
  *
+ * This is enough levels to cover every bit of a deferal_tick_t, so
+ * that any deadline can be placed in the wheel.
  */
+#define DEFERAL_WHEEL_LEVELS \
+    ((sizeof(deferal_tick_t) * 8 + DEFERAL_WHEEL_BITS - 1) / DEFERAL_WHEEL_BITS)
+
+#if DEFERAL_WHEEL_BITS <= 3
+typedef uint8_t deferal_slotmap_t;
+#elif DEFERAL_WHEEL_BITS == 4
+typedef uint16_t deferal_slotmap_t;
+#elif DEFERAL_WHEEL_BITS == 5
+typedef uint32_t deferal_slotmap_t;
+#elif DEFERAL_WHEEL_BITS == 6
+typedef uint64_t deferal_slotmap_t;
+#else
+#error "DEFERAL_WHEEL_BITS must be no greater than 6"
+#endif
 
 #ifdef UNIT_TESTING
-extern int ulo_cmp(unsigned long x, unsigned long y);
+extern int ulo_cmp(deferal_tick_t x, deferal_tick_t y);
+#endif
+
+#ifdef DEFERAL_STATS
+/**
+ * @brief The number of buckets in each DeferalHistogram.
+ */
+#ifndef DEFERAL_STATS_BUCKETS
+#define DEFERAL_STATS_BUCKETS 16
+#endif
+
+/**
+ * @brief The timer function used to time post Deferal functions and
+ * the intervals between polls, when DEFERAL_STATS is defined.
+ */
+#ifndef DEFERAL_STATS_CLOCK
+#define DEFERAL_STATS_CLOCK micros
 #endif
 
-class Deferal {
+/**
+ * @class DeferalHistogram
+ * @brief A histogram of times, with buckets of exponentially
+ * increasing size.
+ *
+ * Bucket 0 counts values of 0, and bucket i counts values from
+ * 2^(i-1) to 2^i - 1, except for the last bucket which counts every
+ * larger value too.
+ */
+class DeferalHistogram {
   public:
-    Deferal(unsigned long delay, bool autorepeat=false,
-	    bool start=true, TimerFn timer_fn = millis);
-    Deferal(unsigned long delay, PostDeferalFn fn,
-	    void *param = NULL,  bool autorepeat=false,
-	    bool start=true, TimerFn timer_fn = millis);
+    constexpr DeferalHistogram():
+	count_(0), total_(0), max_(0), buckets_() {}
 
-    ~Deferal();
-    
-    static Deferal *checkDeferals();
+    void record(unsigned long value);
+    void clear();
 
-#ifdef UNIT_TESTING
-    static void clearDeferals();
-    void reset(unsigned long delay, bool autorepeat,
-	       bool start, TimerFn timer_fn);
+    /// Return the number of values recorded.
+    unsigned long count() { return count_; }
+    /// Return the largest value recorded.
+    unsigned long max() { return max_; }
+    /// Return the mean of the values recorded.
+    unsigned long mean() { return count_? total_ / count_: 0; }
+    /// Return the number of values recorded in a bucket.
+    unsigned long bucket(int i) { return buckets_[i]; }
+    /// Return the smallest value counted in a bucket.
+    static unsigned long bucketFloor(int i) { return i? 1UL << (i - 1): 0; }
+
+  protected:
+    unsigned long count_;
+    unsigned long total_;
+    unsigned long max_;
+    unsigned long buckets_[DEFERAL_STATS_BUCKETS];
+};
+
+/**
+ * @class DeferalStats
+ * @brief Statistics on the expiry of Deferals.
+ *
+ * These are only collected if DEFERAL_STATS is defined.  Global
+ * statistics, for every Deferal, are returned by global().
+ * Statistics may also be kept for individual Deferals, by giving
+ * each a DeferalStats of its own with setStats().  This allows the
+ * Deferals, or post Deferal functions, responsible for jitter to be
+ * identified.
+ *
+ * Lateness is the time, in units of the Deferal's clock, from the
+ * expiry time of a Deferal to its expiry being noticed by
+ * checkDeferals(), drainExpired() or a status check.  Callback times
+ * and poll intervals are in units of DEFERAL_STATS_CLOCK.
+ */
+class DeferalStats {
+    friend class DeferalBase;
+
+  public:
+    constexpr DeferalStats():
+	lateness_(), callback_time_(), missed_(0) {}
+
+    /// Return the histogram of expiry lateness.
+    DeferalHistogram *lateness() { return &lateness_; }
+    /// Return the histogram of post Deferal function durations.
+    DeferalHistogram *callbackTime() { return &callback_time_; }
+    /// Return the number of periods that autorepeating Deferals have
+    /// had to catch up on, having expired more than a period late.
+    unsigned long missed() { return missed_; }
+    void clear();
+
+    /// Return the statistics for all Deferals.
+    static DeferalStats *global() { return &global_; }
+    /// Return the histogram of intervals between polls by
+    /// checkDeferals() or drainExpired().
+    static DeferalHistogram *pollIntervals() { return &poll_intervals_; }
+    static void recordPoll();
+    static void clearGlobal();
+
+  protected:
+    DeferalHistogram lateness_;
+    DeferalHistogram callback_time_;
+    unsigned long missed_;
+
+    static DeferalStats global_;
+    static DeferalHistogram poll_intervals_;
+    static bool polled_;
+    static unsigned long last_poll_;
+};
 #endif
-    
-    void start(unsigned long delay = 0);
-    void stop(bool run_post_fn=true, bool allow_repeat=false);
-    void pause();
-    void resume();
-    bool stopped();
-    bool paused();
-    bool running();
-    long remaining();
-    long delayPeriod();
-    deferal_status_t status();
-    void again(unsigned long delay = 0, bool run_post_fn=true);
-    void setDeferalFn(PostDeferalFn fn, void *param = NULL);
-    void setDelay(unsigned long delay);
-    void setOffset(unsigned long offset);
+
+#ifdef DEFERAL_THREADS
+/**
+ * @brief The number of calls that may be queued for each worker of a
+ * DeferalExecutor.
+ */
+#ifndef DEFERAL_EXECUTOR_QUEUE
+#define DEFERAL_EXECUTOR_QUEUE 1024
+#endif
+
+/**
+ * @class DeferalExecutor
+ * @brief A pool of worker threads that run post Deferal functions.
+ *
+ * Normally the thread that polls with checkDeferals() or
+ * drainExpired() runs each post Deferal function itself, so one slow
+ * function delays every expiry behind it.  Once an executor is set,
+ * using Deferal::setExecutor(), the poller only detects expiries,
+ * handing each call to a worker.  Each worker has its own queue, and
+ * idle workers steal from the others.  If every queue is full, the
+ * poller makes the call itself.
+ *
+ * By default the calls for each Deferal are serialised, so that, for
+ * instance, an autorepeating Deferal never runs its function
+ * concurrently with itself; see Deferal::setSerial().
+ *
+ *     DeferalExecutor pool(4);
+ *     Deferal::setExecutor(&pool);
+ *
+ * A Deferal must not be destroyed, nor the executor unset, while
+ * calls for it may be outstanding: wait() waits for them all.
+ *
+ * This is only available if DEFERAL_THREADS is defined.
+ */
+class DeferalExecutor {
+  public:
+    DeferalExecutor(unsigned workers);
+    ~DeferalExecutor();
+
+    void submit(DeferalBase *serial, PostDeferalFn fn, void *param);
+    void wait();
+
+    /// Return the number of calls completed.
+    unsigned long completed() { return completed_; }
+    /// Return the number of calls made by the poller because every
+    /// queue was full.
+    unsigned long inlined() { return inlined_; }
+    /// Return the longest time, in nanoseconds, that a call waited
+    /// between submission and starting to run.
+    unsigned long maxLatency() { return max_latency_; }
+    unsigned long meanLatency();
+    void clearCounts();
+
   protected:
-    static void addDeferalEntry(Deferal *entry);
-    static void removeDeferalEntry(Deferal *to_remove);
+    /**
+     * @brief A queued call.
+     */
+    struct Task {
+	DeferalBase *serial;
+	PostDeferalFn fn;
+	void *param;
+	uint64_t submitted;
+    };
 
-    static Deferal *deferal_list_;
+    /**
+     * @brief A worker thread, with its queue of calls.
+     */
+    struct Worker {
+	std::mutex lock;
+	Task tasks[DEFERAL_EXECUTOR_QUEUE];
+	unsigned head;
+	unsigned count;
+	std::thread thread;
+    };
 
-    void init(unsigned long delay, bool autorepeat,
-	      bool start, TimerFn timer_fn);
-    bool expired();
-    void updateStatus();
+    static uint64_t nowNs();
+    bool push(Worker *worker, const Task &task);
+    bool pop(Worker *worker, Task *task, bool steal);
+    bool take(unsigned self, Task *task);
+    void run(const Task &task);
+    void work(unsigned self);
+
+    /// The workers.
+    Worker *workers_;
+
+    /// The number of workers.
+    unsigned nworkers_;
+
+    /// The worker to which the next call is offered first.  This is
+    /// only a hint, but several pollers, each with its own
+    /// DeferalShard, may submit calls at once.
+    std::atomic<unsigned> next_;
+
+    /// The number of calls queued but not yet taken by a worker.
+    std::atomic<unsigned long> queued_;
+
+    /// The number of calls submitted but not yet completed.
+    std::atomic<unsigned long> outstanding_;
+
+    /// The number of workers waiting for calls.
+    std::atomic<unsigned> sleepers_;
+
+    /// Whether the workers are to exit.
+    std::atomic<bool> stopping_;
+
+    /// Protects the sleep of idle workers.
+    std::mutex idle_lock_;
+    std::condition_variable idle_;
+
+    std::atomic<unsigned long> completed_;
+    std::atomic<unsigned long> inlined_;
+    std::atomic<unsigned long> started_;
+    std::atomic<uint64_t> total_latency_;
+    std::atomic<unsigned long> max_latency_;
+};
+#endif
+
+#ifdef DEFERAL_COROUTINES
+/**
+ * @class DeferalAwaiter
+ * @brief The part of an awaiter, such as that returned by
+ * deferalSleepFor(), that resumes its coroutine.
+ *
+ * A coroutine cannot be resumed from within its Deferal's post
+ * Deferal function, as the Deferal is still in use by the poll and
+ * resuming could destroy it.  Instead, the post Deferal function
+ * adds the awaiter to a ready list, and the coroutine is resumed once
+ * the poll no longer needs the Deferal: at the end of
+ * Deferal::drainExpired() (and of DeferalCounter::advance() and
+ * DeferalShard::drainExpired()), or at the start of the next call to
+ * Deferal::checkDeferals().
+ */
+class DeferalAwaiter {
+  public:
+    static void resumeReady();
+    static bool awaits(PostDeferalFn fn);
 
-    /// Whether to automatically restart when we expire 
-    bool             autorepeat_; 
+  protected:
+    void ready();
+    static void readyFn(void *awaiter);
+
+    /// The coroutine waiting on us.
+    std::coroutine_handle<> handle_;
+
+    /// The next awaiter in the ready list.
+    DeferalAwaiter *next_ready_;
+
+    static DEFERAL_THREAD_LOCAL DeferalAwaiter *ready_head_;
+    static DEFERAL_THREAD_LOCAL DeferalAwaiter *ready_tail_;
+};
+#endif
+
+/**
+ * @class DeferalBase
+ * @brief The state of a Deferal that does not depend on its clock.
+ *
+ * This is all that a DeferalWheel needs to know about the Deferals
+ * that it contains.
+ */
+class DeferalBase {
+    friend class DeferalWheel;
+#ifdef DEFERAL_THREADS
+    friend class DeferalExecutor;
+#endif
+
+  protected:
+    static void linkEntry(DeferalBase **bucket, DeferalBase *entry);
+    static void unlinkEntry(DeferalBase *entry);
+    static DeferalBase *earliestEntry(DeferalBase *head);
+    void moveFrom(DeferalBase &other);
+
+    static volatile bool wake_requested_;
+#ifdef DEFERAL_THREADS
+    static DeferalExecutor *executor_;
+
+    /// Return whether our post Deferal function is to be run by the
+    /// executor.  Those of coroutine awaiters never are, as their
+    /// coroutines must be made ready on the polling thread.
+    bool executed() {
+#ifdef DEFERAL_COROUTINES
+	if (DeferalAwaiter::awaits(defer_fn_)) {
+	    return false;
+	}
+#endif
+	return executor_ != NULL;
+    }
+#endif
 
-    /// The time, in timer_fn_() units, that the Deferal last started to run
-    unsigned long    start_time_;
+#ifdef DEFERAL_STATS
+    void callDeferFn();
+    void recordLateness(deferal_tick_t lateness);
+    void recordMissed(unsigned long missed);
+#else
+    /// Call the post Deferal function, which must not be NULL.
+    void callDeferFn() {
+#ifdef DEFERAL_THREADS
+	if (executed()) {
+	    executor_->submit(exec_serial_? this: NULL,
+			      defer_fn_, defer_fn_param_);
+	    return;
+	}
+#endif
+	defer_fn_(defer_fn_param_);
+    }
+#endif
 
-    /// The time, in timer_fn_() units, that the Deferal is to run for
-    /// from Deferal#start_time_
-    unsigned long    delay_time_;
+    /// Return the time, in clock units, at which a running Deferal
+    /// is due to expire.
+    deferal_tick_t expiryTime() {
+	return (deferal_tick_t) (start_time_ + delay_time_);
+    }
+    deferal_tick_t wheelTime();
 
-    /// The time, in timer_fn_() units, that a paused Deferal will
-    /// have remaining when it is resumed,
-    unsigned long    remaining_time_;
+    /* The fields are ordered largest first, so that no space is lost
+     * to padding. */
 
-    /// The current status of the Deferal.
-    deferal_status_t status_;
-    
     /// The function to be called when the Deferal expires.  May be
     /// NULL if nothing is to be done (ie expiry is to be handled by
     /// other means).
     PostDeferalFn defer_fn_;
-    
-    /// The parameter to be passed to Deferal::defer_fn_()
+
+    /// The parameter to be passed to DeferalBase::defer_fn_()
     void * defer_fn_param_;
-    
-    /// The function to be called in order to figure out the progress
-    /// of a Deferal.  By default this will be millis().
-    TimerFn timer_fn_;
 
-    /// For a running Deferal, this identifies the next Deferal in 
-    /// Deferal::deferal_list_.  This will be NULL if we are nut
-    /// running, or if we are the last Deferal in the list.
-    Deferal *next_; 
-    
+    /// For a running Deferal, this identifies the next Deferal in
+    /// the circular list headed by DeferalBase#bucket_.
+    DeferalBase *next_;
+
+    /// For a running Deferal, this identifies the previous Deferal in
+    /// the circular list headed by DeferalBase#bucket_.
+    DeferalBase *prev_;
+
+    /// The list head (a slot of our wheel, its due list, or its
+    /// draining list) that we are linked into.  This will be NULL if
+    /// we are not in any list.
+    DeferalBase **bucket_;
+
+#ifdef DEFERAL_STATS
+    /// Statistics for this Deferal, if any are to be kept.
+    DeferalStats *stats_;
+#endif
+
+#if DEFERAL_FN_SIZE > 0
+    static_assert(DEFERAL_FN_SIZE % sizeof(void *) == 0,
+		  "DEFERAL_FN_SIZE must be a multiple of the size of a pointer");
+
+    /// The captures of a functor too big to be stored in
+    /// DeferalBase#defer_fn_param_.
+    alignas(void *) unsigned char fn_storage_[DEFERAL_FN_SIZE];
+#endif
+
+#ifdef DEFERAL_THREADS
+    /// The latest command submitted by another thread and not yet
+    /// applied: the delay shifted left by DEFERAL_CMD_BITS, plus the
+    /// deferal_command_t plus 1, or 0 if there is none.
+    std::atomic<uint64_t> async_cmd_;
+
+    /// The next Deferal in the list of those with submitted commands.
+    DeferalBase *async_next_;
+#endif
+
+    /// The time, in clock units, that the Deferal last started to
+    /// run.  While the Deferal is paused, this is instead the time
+    /// that it had been running for when it was paused.
+    deferal_tick_t   start_time_;
+
+    /// The time, in clock units, that the Deferal is to run for
+    /// from DeferalBase#start_time_
+    deferal_tick_t   delay_time_;
+
+    /// The current status of the Deferal, a deferal_status_t.
+    uint8_t          status_: 6;
+
+    /// Whether to automatically restart when we expire
+    uint8_t          autorepeat_: 1;
+
+    /// Whether a restart that only delays our expiry leaves us in our
+    /// slot of the wheel, to be placed again when the slot comes due.
+    uint8_t          lazy_: 1;
+
+    /// How we catch up on missed periods, a deferal_catchup_t.
+    uint8_t          catchup_: 2;
+
+    /// The most calls to make for missed periods, for
+    /// DEFERAL_CATCHUP_BURST.
+    uint8_t          burst_: 6;
+
+    /// The number of periods missed by the last call to again(),
+    /// saturating at 65535.
+    uint16_t         missed_;
+
+    /// How long after its expiry time the Deferal may be reported as
+    /// expired, so that it can be coalesced with others.
+    uint16_t         slack_;
+
+#ifdef DEFERAL_THREADS
+    /// Whether we are in the list of Deferals with submitted commands.
+    std::atomic<bool> async_queued_;
+
+    /// Whether calls made for us by a DeferalExecutor are serialised.
+    bool exec_serial_;
+
+    /// For serialised calls, the number submitted to a
+    /// DeferalExecutor and not yet completed.
+    std::atomic<uint32_t> exec_pending_;
+#endif
 };
 
+/**
+ * @class DeferalWheel
+ * @brief A hierarchical timing wheel of running Deferals.
+ *
+ * There is one wheel for each clock in use, each ordering the
+ * Deferals that use that clock, and each keeping its own snapshot of
+ * the current time within a tick.
+ *
+ * Running Deferals are placed in a slot according to their expiry
+ * time (DeferalBase#start_time_ + DeferalBase#delay_time_).  Level 0
+ * has one slot per tick, and each higher level has slots covering
+ * DEFERAL_WHEEL_SLOTS times as many ticks as the level below.  As
+ * the wheel advances into the range of a higher level slot, the
+ * Deferals in that slot are cascaded down into the lower levels.
+ *
+ * Level 0 slots whose tick has passed are moved onto the due list,
+ * from which Deferal::checkDeferals() reports them one at a time.
+ * Adding and removing a Deferal are O(1) operations, and advancing
+ * the wheel costs O(expired + 1), as empty slots are skipped using
+ * a bitmap of occupied slots for each level.
+ *
+ * Ticks are compared using ulo_cmp() so, as for Deferals themselves,
+ * the wheel correctly handles the wrap-around of the timer function.
+ */
+class DeferalWheel {
+  public:
+    constexpr DeferalWheel(TimerFn clock):
+	clock_(clock), next_(NULL),
+#ifdef DEFERAL_THREADS
+	inbox_(NULL),
+#endif
+	tick_(0), time_(0),
+	base_(0), count_(0), due_(NULL), draining_(NULL),
+	occupied_(), slots_() {}
+
+    static void beginTick();
+    static void endTick();
+    /// Predicate: true if we are within a tick.
+    static bool inTick() { return in_tick_; }
+
+    deferal_tick_t now();
+    void insert(DeferalBase *entry);
+    void remove(DeferalBase *entry);
+    bool keep(DeferalBase *entry, deferal_tick_t placed);
+    DeferalBase *expire();
+    DeferalBase *collect();
+    /// Return the first Deferal on the draining list.
+    DeferalBase *draining() { return draining_; }
+    DeferalBase *earliest();
+    void clear();
+
+    /// The timer function for all Deferals in this wheel.  This is
+    /// NULL for a DeferalCounter.
+    TimerFn clock_;
+
+    /// The next wheel in the list of wheels for a clock type.  With
+    /// DEFERAL_THREADS, wheelFor() may append to the list while it is
+    /// being read.
+#ifdef DEFERAL_THREADS
+    std::atomic<DeferalWheel *> next_;
+#else
+    DeferalWheel *next_;
+#endif
+
+#ifdef DEFERAL_THREADS
+    /// The most recently submitted of the Deferals in this wheel with
+    /// commands from other threads, linked by
+    /// DeferalBase::async_next_.  Producers push onto this, and the
+    /// thread that owns the wheel takes the whole list at once, so
+    /// there is no ABA problem.
+    std::atomic<DeferalBase *> inbox_;
+#endif
+
+  protected:
+    void advanceTo(deferal_tick_t now);
+    void moveTo(deferal_tick_t tick);
+    void cascade(int level, unsigned idx);
+    void place(DeferalBase *entry);
+    deferal_slotmap_t laterSlots(int level);
+    int firstSlot(int level);
+
+    static DEFERAL_THREAD_LOCAL bool in_tick_;
+    static DEFERAL_THREAD_LOCAL unsigned long current_tick_;
+
+    /// The value of DeferalWheel#current_tick_ when #time_ was read.
+    unsigned long tick_;
+
+    /// The value of our timer function at the start of tick #tick_,
+    /// or, for a DeferalCounter, the current count.
+    deferal_tick_t time_;
+
+    /// The next tick that has yet to be processed by advanceTo().
+    deferal_tick_t base_;
+
+    /// The number of Deferals in the wheel, including the due and
+    /// draining lists.
+    unsigned long count_;
+
+    /// Deferals whose expiry time has been passed by the wheel, in
+    /// order of expiry.
+    DeferalBase *due_;
+
+    /// Expired Deferals waiting to be stopped by a drain.  Deferals
+    /// are moved here from #due_ before any are stopped, so that post
+    /// Deferal functions may start and stop other Deferals without
+    /// upsetting the drain.
+    DeferalBase *draining_;
+
+    /// A bitmap of occupied slots for each level.
+    deferal_slotmap_t occupied_[DEFERAL_WHEEL_LEVELS];
+
+    /// The slots of the wheel.  Each is the head of a circular list
+    /// of Deferals.
+    DeferalBase *slots_[DEFERAL_WHEEL_LEVELS][DEFERAL_WHEEL_SLOTS];
+};
+
+/**
+ * @class DeferalCounter
+ * @brief An event clock, whose time is a count advanced explicitly.
+ *
+ * Rather than providing a timer function that counts, for instance,
+ * characters read or loop iterations, and having every Deferal
+ * checked against it, Deferals may be bound to a DeferalCounter.
+ * Calling advance() then expires exactly those Deferals whose delay
+ * has been reached.  A DeferalCounter is never read by
+ * Deferal::checkDeferals() or Deferal::drainExpired().
+ *
+ *     DeferalCounter bytes_read;
+ *     Deferal timeout(64, &flush_fn, NULL, true, true, bytes_read);
+ *     ...
+ *     bytes_read.advance(Serial.readBytes(buf, len));
+ */
+class DeferalCounter: public DeferalWheel {
+  public:
+    constexpr DeferalCounter(): DeferalWheel(NULL) {}
+
+    int advance(unsigned long n = 1, DeferalVisitorFn fn = NULL,
+		void *param = NULL);
+
+    /// Return the current count.
+    unsigned long value() { return time_; }
+};
+
+#ifdef DEFERAL_THREADS
+/**
+ * @class DeferalShard
+ * @brief A wheel of Deferals owned by a single thread.
+ *
+ * Where a single dispatcher cannot keep up, each thread may own a
+ * shard, with Deferals bound to it in the same way as to a
+ * DeferalCounter.  A shard is never read by Deferal::checkDeferals()
+ * or Deferal::drainExpired(); instead its owner polls it with its own
+ * checkDeferals() or drainExpired().  Only the owner may start, stop
+ * or otherwise use the shard's Deferals, so threads never contend
+ * for a wheel.  Other threads may still use startAsync() and
+ * friends, and a Deferal may be moved to another shard by
+ * Deferal::migrate().
+ *
+ *     // In each worker thread
+ *     DeferalShard shard;
+ *     Deferal idle(30000, &close_fn, conn, false, true, shard);
+ *     ...
+ *     shard.drainExpired();
+ *
+ * This is only available if DEFERAL_THREADS is defined.
+ */
+class DeferalShard: public DeferalWheel {
+  public:
+    /// Create a shard for Deferals using timer_fn, by default millis().
+    DeferalShard(TimerFn timer_fn = millis): DeferalWheel(timer_fn) {}
+
+    BasicDeferal<TimerFnClock> *checkDeferals();
+    int drainExpired(DeferalVisitorFn fn = NULL, void *param = NULL);
+};
+#endif
+
+/**
+ * @class TimerFnClock
+ * @brief The clock policy for Deferal, using a timer function chosen
+ * at run time.
+ *
+ * Each timer function has its own DeferalWheel, which is allocated
+ * the first time that the timer function is used.  A Deferal records
+ * its wheel, through which the timer function is called.
+ *
+ * A clock policy for BasicDeferal must provide:
+ *  - now(), returning the current time;
+ *  - wheel(), returning the DeferalWheel for the Deferal;
+ *  - static wheels(), returning the first of the list of wheels
+ *    that Deferals using the policy may be in.
+ */
+class TimerFnClock {
+  public:
+    /// Use the wheel for a timer function, by default millis().
+    TimerFnClock(TimerFn timer_fn = millis): wheel_(wheelFor(timer_fn)) {}
+    /// Use a given wheel, usually a DeferalCounter.
+    TimerFnClock(DeferalWheel &wheel): wheel_(&wheel) {}
+
+    /// Return the current time from our wheel.
+    deferal_tick_t now() { return wheel_->now(); }
+    /// Return our wheel.
+    DeferalWheel *wheel() { return wheel_; }
+    /// Return the list of wheels for all timer functions in use.
+    static DeferalWheel *wheels() { return wheels_; }
+    static DeferalWheel *wheelFor(TimerFn timer_fn);
+
+  protected:
+    /// The timing wheel for the timer function used to figure out
+    /// the progress of a Deferal.  By default this will be the wheel
+    /// for millis().
+    DeferalWheel *wheel_;
+
+    static DeferalWheel millis_wheel_;
+    static DeferalWheel *wheels_;
+};
+
+/**
+ * @class MillisClock
+ * @brief A clock policy for BasicDeferal, using millis().
+ *
+ * BasicDeferal<MillisClock> objects call millis() directly, rather
+ * than through a function pointer, and do not need to record which
+ * wheel they are in.  They have a wheel of their own, so must be
+ * polled using MillisDeferal::checkDeferals() rather than
+ * Deferal::checkDeferals().
+ */
+class MillisClock {
+  public:
+    /// Return the current time.
+    static unsigned long now() {
+	return DeferalWheel::inTick()? wheel()->now(): millis();
+    }
+    /// Return the wheel for all BasicDeferal<MillisClock> objects.
+    static DeferalWheel *wheel() {
+	static DeferalWheel wheel(millis);
+	return &wheel;
+    }
+    /// Return the list of wheels, which is just our wheel.
+    static DeferalWheel *wheels() { return wheel(); }
+};
+
+/**
+ * @class BasicDeferal
+ * @brief The Deferal class template
+ *
+ * A Deferal is an object for handling timeouts and other period-based
+ * activities.  Deferals provide non-blocking timed operations that
+ * can be single-shot or repetitive.  Multiple Deferals can run
+ * simultaneously.  A Deferal may be given a callback function which
+ * will be called when it expires.
+ *
+ * The Clock template parameter is a clock policy (see TimerFnClock),
+ * which tells the time.  The usual Deferal class uses TimerFnClock,
+ * allowing the timer function to be chosen when each Deferal is
+ * created.  A policy such as MillisClock, which calls its timer
+ * function directly and has no state, makes status checks cheaper
+ * and each Deferal smaller.
+ *
+ * Deferals must be periodically checked by polling for expired
+ * Deferals using Deferal::checkDeferals().  This returns the latest
+ * unreported expired Deferal.  Alternatively, Deferal::drainExpired()
+ * expires every Deferal that is due in a single call.
+ *
+ * The basic operations on a Deferal are:
+ *  - creation.
+ *    The constructors define the delay period, whether to
+ *    automatically start, the function to be used to tell the time
+ *    (defaulting to millis()) and any function, with parameter, to be
+ *    called when the Deferal expires.
+ *
+ *  - start
+ *    start() optionally redefines the delay period.  It starts from
+ *    the current time.
+ *
+ *  - stop
+ *    stop() stops the current deferal, optionally running the expiry
+ *    function.
+ *
+ *  - pause
+ *    pause() stops the current deferal, recording the time remaining.
+ *
+ *  - resume
+ *    resume() resumes the current deferal, for the period given by the
+ *    remaining time after a pause.  Resuming a stopped or running
+ *    Deferal does nothing.
+ *
+ *  - repeat
+ *    again() runs the current deferal with the delay period set as if
+ *    the Deferal had immediately restarted after completion.  Ie if
+ *    the delay period is 1000, but again() was called 100 ticks after
+ *    the Deferal completed, the remaining delay period will be 900.
+ *    If the Deferal should have run to completion by now, it will
+ *    immediately complete and call any post deferal function.
+ *
+ *  - test
+ *    running(), paused() stopped() and status() give the current
+ *    status of a Deferal in different, obvious, ways.
+ *
+ *  - ticks
+ *    beginTick() and endTick() bracket a period, typically one pass
+ *    of the main loop, during which each timer function is read only
+ *    once, giving all Deferals a consistent view of the current time.
+ *
+ *  - scheduling
+ *    nextExpiry() and timeUntilNextExpiry() identify the running
+ *    Deferal that will expire first, so that callers can tell how
+ *    long they may wait before calling checkDeferals().
+ *
+ *  - modification
+ *    setDeferalFn() sets the function to be run on completion of the
+ *    Deferal, setDelay() updates the delay time, causing the Deferal
+ *    to stop and the post Deferal function to be called if
+ *    appropriate.
+ *
+ */
+template <class Clock>
+class BasicDeferal: public DeferalBase, protected Clock {
+    friend class DeferalCounter;
+#ifdef DEFERAL_COROUTINES
+    friend class DeferalWait;
+#endif
+#ifdef DEFERAL_THREADS
+    friend class DeferalShard;
+#endif
+
+  public:
+    /// Function Prototype for functions called for each Deferal
+    /// expired by drainExpired().
+    typedef void (*VisitorFn)(BasicDeferal *deferal, void *param);
+
+    BasicDeferal(unsigned long delay, bool autorepeat=false,
+		 bool start=true, Clock clock = Clock());
+    BasicDeferal(unsigned long delay, PostDeferalFn fn,
+		 void *param = NULL,  bool autorepeat=false,
+		 bool start=true, Clock clock = Clock());
+    template <class F, class = decltype(((F *) 0)->operator()())>
+    BasicDeferal(unsigned long delay, F fn, bool autorepeat=false,
+		 bool start=true, Clock clock = Clock());
+
+    BasicDeferal(BasicDeferal &&other) noexcept;
+    BasicDeferal &operator=(BasicDeferal &&other) noexcept;
+    /// Deferals may be moved, but not copied, as a copy of a running
+    /// Deferal would have no place in its wheel.
+    BasicDeferal(const BasicDeferal &) = delete;
+    BasicDeferal &operator=(const BasicDeferal &) = delete;
+
+    ~BasicDeferal();
+
+    static BasicDeferal *checkDeferals();
+    static int drainExpired(VisitorFn fn = NULL, void *param = NULL);
+    static void beginTick();
+    static void endTick();
+    static unsigned long tickTime(Clock clock = Clock());
+    static BasicDeferal *nextExpiry(Clock clock = Clock());
+    static unsigned long timeUntilNextExpiry(Clock clock = Clock());
+    static bool idleUntilNext(Clock clock = Clock());
+    /// Set the hook used by idleUntilNext() to sleep.
+    static void setSleepFn(DeferalSleepFn fn) { sleep_fn_ = fn; }
+    static void wake();
+
+    bool startFromISR(unsigned long delay = 0);
+    bool stopFromISR(bool run_post_fn = true);
+    bool againFromISR(unsigned long delay = 0);
+    static void applyISRCommands();
+
+#ifdef DEFERAL_THREADS
+    void startAsync(unsigned long delay = 0);
+    void stopAsync(bool run_post_fn = true);
+    void againAsync(unsigned long delay = 0);
+    static void applyAsyncCommands();
+    void migrate(DeferalWheel &to);
+    /// Have post Deferal functions run by executor, or by the poller
+    /// if executor is NULL.
+    static void setExecutor(DeferalExecutor *executor) {
+	executor_ = executor;
+    }
+    /// Set whether calls to our post Deferal function by an executor
+    /// must not overlap.  This is true by default.
+    void setSerial(bool serial) { exec_serial_ = serial; }
+#endif
+
+#ifdef UNIT_TESTING
+    static void clearDeferals();
+    void reset(unsigned long delay, bool autorepeat,
+	       bool start, Clock clock = Clock());
+#endif
+
+    void start(unsigned long delay = 0);
+    void stop(bool run_post_fn=true, bool allow_repeat=false);
+    void pause();
+    void resume();
+    bool stopped();
+    bool paused();
+    bool running();
+    long remaining();
+    long delayPeriod();
+    deferal_status_t status();
+    void again(unsigned long delay = 0, bool run_post_fn=true);
+    void setDeferalFn(PostDeferalFn fn, void *param = NULL);
+    template <class F, class = decltype(((F *) 0)->operator()())>
+    void setDeferalFn(F fn);
+    void setDelay(unsigned long delay);
+    void setOffset(unsigned long offset);
+    void setCatchup(deferal_catchup_t policy,
+		    unsigned burst = DEFERAL_MAX_BURST);
+    void setSlack(unsigned long slack);
+    void setLazyRestart(bool lazy = true);
+    /// Return how late the Deferal may be reported as expired.
+    unsigned long slack() { return slack_; }
+    /// Return the policy for catching up on missed periods.
+    deferal_catchup_t catchup() { return (deferal_catchup_t) catchup_; }
+    /// Return the number of periods missed when the Deferal was last
+    /// restarted by again() or by autorepeat.  With
+    /// DEFERAL_CATCHUP_ONCE, this is already set when the post
+    /// Deferal function is called on expiry.
+    unsigned missedPeriods() { return missed_; }
+#ifdef DEFERAL_STATS
+    /// Keep statistics for this Deferal in stats, or stop keeping
+    /// them if stats is NULL.
+    void setStats(DeferalStats *stats) { stats_ = stats; }
+    /// Return the statistics kept for this Deferal, if any.
+    DeferalStats *stats() { return stats_; }
+#endif
+  protected:
+    static void addDeferalEntry(BasicDeferal *entry);
+    static void removeDeferalEntry(BasicDeferal *to_remove);
+    static BasicDeferal *expireNext(DeferalWheel *wheels);
+    static int drain(DeferalWheel *wheels, VisitorFn fn, void *param);
+
+    static DeferalSleepFn sleep_fn_;
+
+    /**
+     * @brief A request from an interrupt handler.
+     */
+    struct ISRCommand {
+	BasicDeferal *deferal;
+	unsigned long delay;
+	uint8_t op;
+    };
+
+    bool pushISRCommand(uint8_t op, unsigned long delay);
+
+    static ISRCommand isr_ring_[DEFERAL_ISR_RING_SIZE];
+    static volatile uint8_t isr_head_;
+    static volatile uint8_t isr_tail_;
+
+#ifdef DEFERAL_THREADS
+    void pushAsyncCommand(uint8_t op, unsigned long delay);
+    static void applyInbox(DeferalWheel *wheel);
+#endif
+
+    void init(unsigned long delay, bool autorepeat, bool start);
+    template <class F> static void invokeParam(void *param);
+    template <class F> static void invokeStored(void *storage);
+    /// Return the current time from our clock.
+    deferal_tick_t now() { return (deferal_tick_t) Clock::now(); }
+    /// Return the wheel for our clock.
+    DeferalWheel *wheel() { return Clock::wheel(); }
+    bool expired();
+    void updateStatus();
+    void noteExpiry();
+    deferal_tick_t periodsMissed(deferal_tick_t start);
+    void setMissed(deferal_tick_t missed);
+};
+
+/**
+ * @brief A Deferal that uses millis(), without the overhead of a
+ * timer function pointer.
+ */
+typedef BasicDeferal<MillisClock> MillisDeferal;
+
+#if defined(__linux__) && defined(DEFERAL_TIMERFD)
+/**
+ * @class DeferalTimerFd
+ * @brief A Linux timerfd that becomes readable when a Deferal is due.
+ *
+ * This allows a program to wait for Deferals, along with its other
+ * file descriptors, using poll(), select() or epoll_wait(), rather
+ * than polling with checkDeferals().  Before each wait, rearm() sets
+ * the timer for the earliest expiry of any Deferal using our timer
+ * function.  When fd() becomes readable, dispatch() expires every
+ * Deferal that is due, exactly as drainExpired() does.
+ *
+ *     DeferalTimerFd timer;
+ *     ...
+ *     while (true) {
+ *         timer.rearm();
+ *         int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+ *         for (int i = 0; i < n; i++) {
+ *             if (events[i].data.fd == timer.fd()) {
+ *                 timer.dispatch();
+ *             }
+ *             ...
+ *         }
+ *     }
+ *
+ * This is only available if DEFERAL_TIMERFD is defined.
+ */
+class DeferalTimerFd {
+  public:
+    DeferalTimerFd(TimerFn timer_fn = millis,
+		   unsigned long ns_per_tick = 1000000);
+    ~DeferalTimerFd();
+
+    /// Return the file descriptor, or -1 if the timerfd could not be
+    /// created.
+    int fd() { return fd_; }
+    void rearm();
+    int dispatch(DeferalVisitorFn fn = NULL, void *param = NULL);
+
+  protected:
+    /// The timerfd.
+    int fd_;
+
+    /// The timer function whose Deferals we wait for.
+    TimerFn timer_fn_;
+
+    /// The length of a tick of our timer function, in nanoseconds.
+    unsigned long ns_per_tick_;
+
+    /// Whether the timerfd is armed.
+    bool armed_;
+
+    /// The time, from our timer function, for which we are armed.
+    deferal_tick_t deadline_;
+};
+#endif
+
+
+/**
+ * @brief Create a new, possibly running, Deferal object.
+ *
+ * Note that the Deferal for each newly started or restarted delay
+ * gets added to the wheel for its clock.
+ *
+ * @param delay  The delay for our deferred operation, based on the
+ * units of our clock.  By default, this will be the number of
+ * milliseconds from now.
+ * @param autorepeat  Whether the deferal automatically restarts after
+ * it expires.
+ * @param start  Whether to start the delay immediately.
+ * @param clock  The clock used to get the current time, in suitable
+ * units.  For a Deferal, this may be given as a timer function, which
+ * defaults to millis(), or a DeferalCounter.
+ */
+template <class Clock>
+BasicDeferal<Clock>::BasicDeferal(unsigned long delay, bool autorepeat,
+				  bool start, Clock clock): Clock(clock)
+{
+    init(delay, autorepeat, start);
+}
+
+/**
+ * @brief Create a new, possibly running, Deferal object, with a
+ * function to be called asynchronously when the delay has expired.
+ *
+ * Note that the Deferal for each newly started or restarted delay
+ * gets added to the wheel for its clock.
+ *
+ * @param delay  The delay for our deferred operation, based on the
+ * units of our clock.  By default, this will be the number of
+ * milliseconds from now.
+ * @param fn  The function to be called on completion of our delay.
+ * @param param  A parameter to be passed to the above function on
+ * completion of our delay.
+ * @param autorepeat  Whether the deferal automatically restarts after
+ * it expires.
+ * @param start  Whether the deferal is to be automatically started.
+ * @param clock  The clock used to get the current time, in suitable
+ * units.  For a Deferal, this may be given as a timer function, which
+ * defaults to millis(), or a DeferalCounter.
+ */
+template <class Clock>
+BasicDeferal<Clock>::BasicDeferal(unsigned long delay, PostDeferalFn fn,
+				  void *param, bool autorepeat,
+				  bool start, Clock clock): Clock(clock)
+{
+    init(delay, autorepeat, start);
+    defer_fn_ = fn;
+    defer_fn_param_ = param;
+}
+
+/**
+ * @brief Create a new, possibly running, Deferal object, with a
+ * lambda or other functor to be called when the delay has expired.
+ *
+ * See setDeferalFn() for the functors that may be used.
+ *
+ * @param delay  As for the other constructors.
+ * @param fn  The functor, taking no arguments.
+ * @param autorepeat  As for the other constructors.
+ * @param start  As for the other constructors.
+ * @param clock  As for the other constructors.
+ */
+template <class Clock>
+template <class F, class>
+BasicDeferal<Clock>::BasicDeferal(unsigned long delay, F fn,
+				  bool autorepeat, bool start,
+				  Clock clock): Clock(clock)
+{
+    init(delay, autorepeat, start);
+    setDeferalFn(fn);
+}
+
+/**
+ * @brief Do the donkey-work of setting up a new Deferal for constructors.
+ */
+template <class Clock>
+void
+BasicDeferal<Clock>::init(unsigned long delay, bool autorepeat, bool start)
+{
+    delay_time_ = delay;
+    start_time_ = now();
+    defer_fn_ = NULL;
+    defer_fn_param_ = NULL;
+    next_ = NULL;
+    prev_ = NULL;
+    bucket_ = NULL;
+#ifdef DEFERAL_STATS
+    stats_ = NULL;
+#endif
+    autorepeat_ = autorepeat;
+    lazy_ = false;
+    catchup_ = DEFERAL_CATCHUP_ALL;
+    burst_ = 0;
+    missed_ = 0;
+    slack_ = 0;
+#ifdef DEFERAL_THREADS
+    async_cmd_ = 0;
+    async_next_ = NULL;
+    async_queued_ = false;
+    exec_serial_ = true;
+    exec_pending_ = 0;
+#endif
+    if (start) {
+	addDeferalEntry(this);
+	status_ = DEFERAL_RUNNING;
+    }
+    else {
+	status_ = DEFERAL_STOPPED;
+    }
+}
+
+/**
+ * @brief Move a Deferal to a new address, as when a std::vector of
+ * Deferals grows.
+ *
+ * The new Deferal takes the place of the old in its wheel, in
+ * constant time, and the old is left stopped, so that Deferals may
+ * be kept by value in arrays and containers.  A Deferal must not be
+ * moved by its own post Deferal function, nor while a command for it
+ * from startFromISR() or startAsync() and friends is pending.
+ */
+template <class Clock>
+BasicDeferal<Clock>::BasicDeferal(BasicDeferal &&other) noexcept:
+    Clock(static_cast<Clock &>(other))
+{
+    moveFrom(other);
+}
+
+/**
+ * @brief Move a Deferal into this one, which is first stopped
+ * without running its post Deferal function.  See the move
+ * constructor.
+ */
+template <class Clock>
+BasicDeferal<Clock> &
+BasicDeferal<Clock>::operator=(BasicDeferal &&other) noexcept
+{
+    if (this != &other) {
+	removeDeferalEntry(this);
+	Clock::operator=(static_cast<Clock &>(other));
+	moveFrom(other);
+    }
+    return *this;
+}
+
+/**
+ * @brief Ensure this Deferal is removed from its wheel on
+ * destruction.  This takes constant time.
+ */
+template <class Clock>
+BasicDeferal<Clock>::~BasicDeferal()
+{
+    removeDeferalEntry(this);
+}
+
+/**
+ * @brief Start a new tick, during which time stands still.
+ *
+ * Until endTick() is called, each timer function is read at most
+ * once: the first time that it is needed.  Every Deferal using the
+ * same timer function then sees the same current time, and checking
+ * the status of a Deferal no longer calls its timer function.
+ *
+ * Calling beginTick() again, without an intervening endTick(), starts
+ * a new tick.  Ticks apply to Deferals of every clock type.
+ */
+template <class Clock>
+void
+BasicDeferal<Clock>::beginTick()
+{
+    DeferalWheel::beginTick();
+}
+
+/**
+ * @brief End the current tick, so that timer functions are once again
+ * read whenever the current time is needed.
+ */
+template <class Clock>
+void
+BasicDeferal<Clock>::endTick()
+{
+    DeferalWheel::endTick();
+}
+
+/**
+ * @brief Return the current time from the given clock.
+ *
+ * Within a tick (see beginTick()), the value first read from the
+ * clock in that tick is returned.
+ */
+template <class Clock>
+unsigned long
+BasicDeferal<Clock>::tickTime(Clock clock)
+{
+    return clock.now();
+}
+
+/**
+ * @brief Check whether any deferals have expired.
+ *
+ * Each wheel is checked in turn, with expired Deferals from a wheel
+ * being reported in order of their expiry times.  The timer function
+ * of a wheel is only read if the wheel contains running Deferals.
+ *
+ * @result An expired Deferal, if one has expired since the last call,
+ * else NULL.
+ */
+template <class Clock>
+BasicDeferal<Clock> *
+BasicDeferal<Clock>::checkDeferals()
+{
+    applyISRCommands();
+#ifdef DEFERAL_STATS
+    DeferalStats::recordPoll();
+#endif
+    return expireNext(Clock::wheels());
+}
+
+/**
+ * @brief Expire the next Deferal that is due in a list of wheels.
+ *
+ * This does the work for checkDeferals() and
+ * DeferalShard::checkDeferals().
+ *
+ * @param wheels  The first of the wheels, linked by
+ * DeferalWheel::next_.
+ * @result An expired Deferal, or NULL.
+ */
+template <class Clock>
+BasicDeferal<Clock> *
+BasicDeferal<Clock>::expireNext(DeferalWheel *wheels)
+{
+#ifdef DEFERAL_COROUTINES
+    DeferalAwaiter::resumeReady();
+#endif
+    for (DeferalWheel *wheel = wheels; wheel; wheel = wheel->next_) {
+#ifdef DEFERAL_THREADS
+	applyInbox(wheel);
+#endif
+	BasicDeferal *entry = static_cast<BasicDeferal *>(wheel->expire());
+	if (entry) {
+	    /* The stop() method will remove entry from the wheel, so
+	     * we don't need to. */
+	    entry->noteExpiry();
+	    entry->stop(true, true);
+	    return entry;
+	}
+    }
+    return NULL;
+}
+
+/**
+ * @brief Expire every Deferal that is due, in a single pass.
+ *
+ * Unless called within a tick started by beginTick(), the drain
+ * takes place in a tick of its own, so each timer function is read
+ * only once.  All expired Deferals are stopped, running their post
+ * Deferal functions and restarting if they autorepeat, exactly as if
+ * each had been returned by checkDeferals().  Post Deferal functions
+ * may start or stop other Deferals: a Deferal that is restarted or
+ * stopped before its turn is not reported.
+ *
+ * @param fn  If not NULL, a function to be called with each expired
+ * Deferal, after it has been stopped.
+ * @param param  A parameter to be passed to fn.
+ * @result The number of Deferals expired.
+ */
+template <class Clock>
+int
+BasicDeferal<Clock>::drainExpired(VisitorFn fn, void *param)
+{
+    bool own_tick = !DeferalWheel::inTick();
+
+    if (own_tick) {
+	beginTick();
+    }
+#ifdef DEFERAL_STATS
+    DeferalStats::recordPoll();
+#endif
+    applyISRCommands();
+    int count = drain(Clock::wheels(), fn, param);
+    if (own_tick) {
+	endTick();
+    }
+    return count;
+}
+
+/**
+ * @brief Expire every Deferal that is due in a list of wheels.
+ *
+ * This does the work for drainExpired(), DeferalCounter::advance()
+ * and DeferalShard::drainExpired().  Any commands from other threads
+ * are applied first.
+ *
+ * @param wheels  The first of the wheels, linked by
+ * DeferalWheel::next_.
+ * @param fn  If not NULL, a function to be called with each expired
+ * Deferal, after it has been stopped.
+ * @param param  A parameter to be passed to fn.
+ * @result The number of Deferals expired.
+ */
+template <class Clock>
+int
+BasicDeferal<Clock>::drain(DeferalWheel *wheels, VisitorFn fn, void *param)
+{
+    DeferalWheel *wheel;
+    DeferalBase *entry;
+    int count = 0;
+    int drained;
+
+    for (wheel = wheels; wheel; wheel = wheel->next_) {
+#ifdef DEFERAL_THREADS
+	applyInbox(wheel);
+#endif
+	wheel->expire();
+    }
+    do {
+	/* Autorepeating Deferals that had fallen behind may be due
+	 * again at the same tick, so we repeat until nothing is
+	 * collected. */
+	drained = 0;
+	for (wheel = wheels; wheel; wheel = wheel->next_) {
+	    wheel->collect();
+	}
+	for (wheel = wheels; wheel; wheel = wheel->next_) {
+	    while ((entry = wheel->draining())) {
+		/* The stop() method will remove entry from the
+		 * draining list. */
+		BasicDeferal *deferal = static_cast<BasicDeferal *>(entry);
+		deferal->noteExpiry();
+		deferal->stop(true, true);
+		if (fn) {
+		    fn(deferal, param);
+		}
+		drained++;
+	    }
+	}
+	count += drained;
+    } while (drained);
+#ifdef DEFERAL_COROUTINES
+    DeferalAwaiter::resumeReady();
+#endif
+    return count;
+}
+
+/**
+ * @brief Identify the running Deferal that will expire first.
+ *
+ * This is found from the wheel for our clock without examining
+ * every running Deferal.
+ *
+ * @param clock  Only Deferals using this clock are considered, as
+ * expiry times from different clocks cannot be compared.  For a
+ * Deferal, this may be given as a timer function.
+ * @result The Deferal with the earliest expiry time, which may
+ * already have passed, or NULL if no Deferal is running.
+ */
+template <class Clock>
+BasicDeferal<Clock> *
+BasicDeferal<Clock>::nextExpiry(Clock clock)
+{
+    return static_cast<BasicDeferal *>(clock.wheel()->earliest());
+}
+
+/**
+ * @brief Return the time until the next Deferal expires.
+ *
+ * This allows a caller to tell how long it may do other things, or
+ * sleep, before checkDeferals() will have anything to report.
+ *
+ * @param clock  The clock whose Deferals are to be considered.  The
+ * result is in units of this clock.
+ * @result The time until the next expiry, 0 if a Deferal has
+ * already expired, or ULONG_MAX if no Deferal is running.
+ */
+template <class Clock>
+unsigned long
+BasicDeferal<Clock>::timeUntilNextExpiry(Clock clock)
+{
+    BasicDeferal *entry = nextExpiry(clock);
+    if (entry) {
+	deferal_stick_t remaining =
+	    (deferal_tick_t) (entry->wheelTime() - clock.now());
+	return (remaining > 0)? remaining: 0;
+    }
+    return ULONG_MAX;
+}
+
+/**
+ * @var BasicDeferal::sleep_fn_
+ * @brief The sleep hook for idleUntilNext(), if any.
+ */
+template <class Clock>
+DeferalSleepFn BasicDeferal<Clock>::sleep_fn_ = NULL;
+
+/**
+ * @brief Sleep until the next Deferal is due to expire, or until
+ * woken by wake().
+ *
+ * Rather than calling checkDeferals() continuously, a loop with
+ * nothing else to do may call idleUntilNext() to sleep, using the
+ * hook set by setSleepFn(), until there is something for
+ * checkDeferals() to report.  If the hook returns early, as it may
+ * on any interrupt, the time until the next expiry is recalculated
+ * and the hook called again.  Any current tick is ended, as time
+ * must move on.
+ *
+ *     Deferal::setSleepFn(deferalSleepIdle);
+ *     ...
+ *     void loop() {
+ *         Deferal::drainExpired();
+ *         Deferal::idleUntilNext();
+ *     }
+ *
+ * @param clock  Only Deferals using this clock are considered, as
+ * times from different clocks cannot be compared.  For a Deferal,
+ * this may be given as a timer function.
+ * @result true if woken by wake(), false if a Deferal is due or if
+ * there is no sleep hook.
+ */
+template <class Clock>
+bool
+BasicDeferal<Clock>::idleUntilNext(Clock clock)
+{
+    if (DeferalWheel::inTick()) {
+	endTick();
+    }
+    while (!wake_requested_) {
+	unsigned long duration = timeUntilNextExpiry(clock);
+	if (!duration || !sleep_fn_) {
+	    return false;
+	}
+	sleep_fn_(duration);
+    }
+    wake_requested_ = false;
+    return true;
+}
+
+/**
+ * @brief Wake from, or prevent the next, idleUntilNext().
+ *
+ * This may be called from an interrupt handler, for instance one
+ * that has received data for the main loop to deal with.  The sleep
+ * hook is expected to return on the interrupt itself.
+ */
+template <class Clock>
+void
+BasicDeferal<Clock>::wake()
+{
+    wake_requested_ = true;
+}
+
+/**
+ * @var BasicDeferal::isr_ring_
+ * @brief Commands from interrupt handlers, waiting to be applied by
+ * applyISRCommands().
+ *
+ * Only interrupt handlers add commands, at #isr_head_, and only the
+ * main loop removes them, at #isr_tail_, so no locking is needed as
+ * long as interrupt handlers cannot interrupt each other, as is the
+ * case on AVR.
+ */
+template <class Clock>
+typename BasicDeferal<Clock>::ISRCommand
+BasicDeferal<Clock>::isr_ring_[DEFERAL_ISR_RING_SIZE];
+
+/**
+ * @var BasicDeferal::isr_head_
+ * @brief The count of commands added to #isr_ring_, modulo 256.
+ */
+template <class Clock>
+volatile uint8_t BasicDeferal<Clock>::isr_head_ = 0;
+
+/**
+ * @var BasicDeferal::isr_tail_
+ * @brief The count of commands applied from #isr_ring_, modulo 256.
+ */
+template <class Clock>
+volatile uint8_t BasicDeferal<Clock>::isr_tail_ = 0;
+
+/**
+ * @brief Queue a command from an interrupt handler.
+ *
+ * @result false if the ring is full, in which case the command is
+ * dropped.
+ */
+template <class Clock>
+bool
+BasicDeferal<Clock>::pushISRCommand(uint8_t op, unsigned long delay)
+{
+    uint8_t head = isr_head_;
+    if ((uint8_t) (head - isr_tail_) >= DEFERAL_ISR_RING_SIZE) {
+	return false;
+    }
+    ISRCommand *cmd = &isr_ring_[head & (DEFERAL_ISR_RING_SIZE - 1)];
+    cmd->deferal = this;
+    cmd->delay = delay;
+    cmd->op = op;
+    DEFERAL_BARRIER();
+    isr_head_ = head + 1;
+    wake_requested_ = true;
+    return true;
+}
+
+/**
+ * @brief Start the Deferal, from an interrupt handler.
+ *
+ * Interrupt handlers must not call start(), stop() or again(), which
+ * change the wheel that checkDeferals() may be working on.  Instead,
+ * the request is queued, and applied when the main loop next calls
+ * checkDeferals() or drainExpired().  This also wakes any
+ * idleUntilNext().
+ *
+ * The Deferal must not be destroyed while the request is queued.
+ *
+ * @param delay  As for start().
+ * @result false if too many requests are queued (see
+ * DEFERAL_ISR_RING_SIZE), in which case the request is dropped.
+ */
+template <class Clock>
+bool
+BasicDeferal<Clock>::startFromISR(unsigned long delay)
+{
+    return pushISRCommand(DEFERAL_CMD_START, delay);
+}
+
+/**
+ * @brief Stop the Deferal, from an interrupt handler.  See
+ * startFromISR().
+ *
+ * @param run_post_fn  As for stop().
+ * @result false if the request had to be dropped.
+ */
+template <class Clock>
+bool
+BasicDeferal<Clock>::stopFromISR(bool run_post_fn)
+{
+    return pushISRCommand(DEFERAL_CMD_STOP, run_post_fn);
+}
+
+/**
+ * @brief Restart the Deferal with again(), from an interrupt handler.
+ * See startFromISR().
+ *
+ * @param delay  As for again().
+ * @result false if the request had to be dropped.
+ */
+template <class Clock>
+bool
+BasicDeferal<Clock>::againFromISR(unsigned long delay)
+{
+    return pushISRCommand(DEFERAL_CMD_AGAIN, delay);
+}
+
+/**
+ * @brief Apply the commands queued by interrupt handlers, in the
+ * order that they were queued.
+ *
+ * This is called by checkDeferals() and drainExpired(), so need only
+ * be called directly by code that checks Deferals by other means.
+ * It must not be called from an interrupt handler.
+ */
+template <class Clock>
+void
+BasicDeferal<Clock>::applyISRCommands()
+{
+    uint8_t tail = isr_tail_;
+    while (tail != isr_head_) {
+	DEFERAL_BARRIER();
+	ISRCommand *cmd = &isr_ring_[tail & (DEFERAL_ISR_RING_SIZE - 1)];
+	BasicDeferal *deferal = cmd->deferal;
+	unsigned long delay = cmd->delay;
+	uint8_t op = cmd->op;
+	DEFERAL_BARRIER();
+	isr_tail_ = ++tail;
+	switch (op) {
+	case DEFERAL_CMD_START:
+	    deferal->start(delay);
+	    break;
+	case DEFERAL_CMD_STOP:
+	    deferal->stop(delay != 0);
+	    break;
+	default:
+	    deferal->again(delay);
+	}
+    }
+}
+
+#ifdef DEFERAL_THREADS
+/**
+ * @brief Submit a command from another thread.
+ *
+ * The command replaces any that is not yet applied, so each Deferal
+ * is in its wheel's inbox at most once, and a producer only touches
+ * the shared inbox when the Deferal is not already in it.
+ */
+template <class Clock>
+void
+BasicDeferal<Clock>::pushAsyncCommand(uint8_t op, unsigned long delay)
+{
+    async_cmd_ = ((uint64_t) delay << DEFERAL_CMD_BITS) | (op + 1);
+    if (!async_queued_.exchange(true)) {
+	std::atomic<DeferalBase *> &inbox = wheel()->inbox_;
+	DeferalBase *head = inbox.load(std::memory_order_relaxed);
+	do {
+	    async_next_ = head;
+	} while (!inbox.compare_exchange_weak(head, this,
+					      std::memory_order_release,
+					      std::memory_order_relaxed));
+    }
+}
+
+/**
+ * @brief Start the Deferal, from a thread other than the dispatcher.
+ *
+ * The request is applied when the thread owning the Deferal's wheel
+ * (the dispatcher, or the owner of its DeferalShard) next polls it.
+ * Until
+ * then, a later request for the same Deferal, from any thread,
+ * replaces it.  This never blocks, and never fails.
+ *
+ * The Deferal must not be destroyed while the request is pending.
+ * This is only available if DEFERAL_THREADS is defined.
+ *
+ * @param delay  As for start().
+ */
+template <class Clock>
+void
+BasicDeferal<Clock>::startAsync(unsigned long delay)
+{
+    pushAsyncCommand(DEFERAL_CMD_START, delay);
+}
+
+/**
+ * @brief Stop the Deferal, from a thread other than the dispatcher.
+ * See startAsync().
+ *
+ * @param run_post_fn  As for stop().
+ */
+template <class Clock>
+void
+BasicDeferal<Clock>::stopAsync(bool run_post_fn)
+{
+    pushAsyncCommand(DEFERAL_CMD_STOP, run_post_fn);
+}
+
+/**
+ * @brief Restart the Deferal with again(), from a thread other than
+ * the dispatcher.  See startAsync().
+ *
+ * @param delay  As for again().
+ */
+template <class Clock>
+void
+BasicDeferal<Clock>::againAsync(unsigned long delay)
+{
+    pushAsyncCommand(DEFERAL_CMD_AGAIN, delay);
+}
+
+/**
+ * @brief Apply the commands submitted by other threads for Deferals
+ * in the wheels for our clock.
+ *
+ * This is called by checkDeferals() and drainExpired(), so need only
+ * be called directly by a dispatcher that checks Deferals by other
+ * means.  It must only be called by the dispatcher.
+ */
+template <class Clock>
+void
+BasicDeferal<Clock>::applyAsyncCommands()
+{
+    for (DeferalWheel *wheel = Clock::wheels(); wheel; wheel = wheel->next_) {
+	applyInbox(wheel);
+    }
+}
+
+/**
+ * @brief Apply the commands submitted for Deferals in a wheel, in the
+ * order that their Deferals were first submitted.
+ */
+template <class Clock>
+void
+BasicDeferal<Clock>::applyInbox(DeferalWheel *wheel)
+{
+    BasicDeferal *list = static_cast<BasicDeferal *>(
+	wheel->inbox_.exchange(NULL, std::memory_order_acquire));
+    DeferalBase *ordered = NULL;
+
+    while (list) {
+	BasicDeferal *next = static_cast<BasicDeferal *>(list->async_next_);
+	list->async_next_ = ordered;
+	ordered = list;
+	list = next;
+    }
+    while (ordered) {
+	BasicDeferal *deferal = static_cast<BasicDeferal *>(ordered);
+	ordered = deferal->async_next_;
+
+	/* The flag must be cleared before the command is taken, so
+	 * that a command submitted in between either is taken now, or
+	 * queues the Deferal again. */
+	deferal->async_queued_ = false;
+	uint64_t cmd = deferal->async_cmd_.exchange(0);
+	if (!cmd) {
+	    continue;
+	}
+	unsigned long delay = (unsigned long) (cmd >> DEFERAL_CMD_BITS);
+	switch ((cmd & ((1 << DEFERAL_CMD_BITS) - 1)) - 1) {
+	case DEFERAL_CMD_START:
+	    deferal->start(delay);
+	    break;
+	case DEFERAL_CMD_STOP:
+	    deferal->stop(delay != 0);
+	    break;
+	case DEFERAL_CMD_AGAIN:
+	    deferal->again(delay);
+	    break;
+	default:
+	    deferal->resume();
+	}
+    }
+}
+
+/**
+ * @brief Move the Deferal to another wheel, usually a DeferalShard
+ * owned by another thread.
+ *
+ * This must be called by the thread that owns the Deferal's current
+ * wheel, while no other thread is submitting commands for it.  A
+ * running Deferal is paused, and resumed by the new owner when it
+ * next polls its wheel, so its remaining time is kept, though it may
+ * expire late if the new owner is slow to poll.  From this call on,
+ * the Deferal belongs to the new owner.
+ *
+ * This is only available for Deferal (not MillisDeferal) and only if
+ * DEFERAL_THREADS is defined.
+ *
+ * @param to  The wheel to move to.  Its timer function should count
+ * in the same units as our current one.
+ */
+template <class Clock>
+void
+BasicDeferal<Clock>::migrate(DeferalWheel &to)
+{
+    applyInbox(wheel());
+    updateStatus();
+    bool was_running = (status_ == DEFERAL_RUNNING);
+    pause();
+    this->wheel_ = &to;
+    if (was_running) {
+	pushAsyncCommand(DEFERAL_CMD_RESUME, 0);
+    }
+}
+#endif
+
+/**
+ * @brief Add a running Deferal object to its wheel.
+ *
+ * If #entry is already in a list it is first removed, so this may be
+ * used to requeue a Deferal whose expiry time has changed.
+ *
+ * @param entry The new Deferal, to be added.
+ */
+template <class Clock>
+void
+BasicDeferal<Clock>::addDeferalEntry(BasicDeferal *entry)
+{
+    removeDeferalEntry(entry);
+    entry->wheel()->insert(entry);
+}
+
+/**
+ * @brief Remove a Deferal object from its wheel.
+ *
+ * If the Deferal is not in its wheel, this does nothing.
+ *
+ * @param to_remove The Deferal to be removed.
+ */
+template <class Clock>
+void
+BasicDeferal<Clock>::removeDeferalEntry(BasicDeferal *to_remove)
+{
+    if (to_remove->bucket_) {
+	to_remove->wheel()->remove(to_remove);
+    }
+}
+
+/**
+ * @brief Start a new delay from now.
+ *
+ * With setLazyRestart(), restarting a running Deferal so that it
+ * expires no earlier than before only records its new expiry time.
+ * The Deferal stays in its slot of the wheel and is placed again
+ * when that slot comes due, so an idle timeout that is restarted far
+ * more often than it expires costs little more than a read of the
+ * timer function for each restart.  It still expires at its new
+ * expiry time.
+ *
+ * @param delay Optionally set a new delay period.
+ */
+template <class Clock>
+void
+BasicDeferal<Clock>::start(unsigned long delay) {
+    deferal_tick_t placed = lazy_? wheelTime(): 0;
+
+    if (delay) {
+	delay_time_ = delay;
+    }
+    start_time_ = now();
+    status_ = DEFERAL_RUNNING;
+    if (!(lazy_ && wheel()->keep(this, placed))) {
+	addDeferalEntry(this);
+    }
+}
+
+/**
+ * @brief Stop the current delay, possibly running our defer_fn_()
+ * @param run_post_fn Whether to run defer_fn_()
+ * @param allow_repeat Whether autorepeat should be allowed.
+ */
+template <class Clock>
+void
+BasicDeferal<Clock>::stop(bool run_post_fn, bool allow_repeat)
+{
+    if (status_ != DEFERAL_STOPPED) {
+	bool repeat = allow_repeat && autorepeat_;
+	// With DEFERAL_CATCHUP_ONCE, this is the one call made for any
+	// missed periods, so it must see how many there were.
+	bool once = repeat && (catchup_ == DEFERAL_CATCHUP_ONCE);
+
+	if (status_ == DEFERAL_PAUSED) {
+	    // Restore the start time from the time run before pausing.
+	    start_time_ = now() - start_time_;
+	}
+	status_ = DEFERAL_STOPPED;
+	removeDeferalEntry(this);
+	if (once) {
+	    setMissed(periodsMissed(start_time_ + delay_time_));
+	}
+	if (run_post_fn && defer_fn_) {
+	    callDeferFn();
+	}
+	if (repeat) {
+	    again(0, !once);
+	}
+    }
+}
+
+template <class Clock>
+bool
+BasicDeferal<Clock>::expired()
+{
+    if (status_ == DEFERAL_RUNNING) {
+	deferal_tick_t elapsed = (deferal_tick_t) (now() - start_time_);
+	// If (now - start_time) > MAXINT/2 then our start time is in
+	// the future.  That's a bid odd but it doesn't mean we have
+	// expired.
+	if (elapsed > (DEFERAL_TICK_MAX >> 1)) {
+	    return false;
+	}
+	return (elapsed >= delay_time_);
+    }
+    return false;
+}
+
+/**
+ * @brief Check the current state of a Deferal, expiring it as needed.
+ *
+ * If a Deferal has passed its completion time, it will be stopped,
+ * possibly running the expiry function, and possibly automatically
+ * restarting it if appropriate.
+ */
+template <class Clock>
+void
+BasicDeferal<Clock>::updateStatus()
+{
+    if (expired()) {
+	noteExpiry();
+	stop(true, true);
+    }
+}
+
+/**
+ * @brief Record the lateness of an expiring Deferal, if statistics
+ * are being kept.
+ */
+template <class Clock>
+void
+BasicDeferal<Clock>::noteExpiry()
+{
+#ifdef DEFERAL_STATS
+    recordLateness((deferal_tick_t) (now() - expiryTime()));
+#endif
+}
+
+/**
+ * @brief Predicate: true if the Deferal is in the stopped state.
+ */
+template <class Clock>
+bool
+BasicDeferal<Clock>::stopped()
+{
+    updateStatus();
+    return status_ == DEFERAL_STOPPED;
+}
+
+/**
+ * @brief Predicate: true if the Deferal is in the running state.
+ */
+template <class Clock>
+bool
+BasicDeferal<Clock>::running()
+{
+    updateStatus();
+    return status_ == DEFERAL_RUNNING;
+}
+
+/**
+ * @brief Predicate: true if the Deferal is in the paused state.
+ */
+template <class Clock>
+bool
+BasicDeferal<Clock>::paused()
+{
+    updateStatus();
+    return status_ == DEFERAL_PAUSED;
+}
+
+/**
+ * @brief Return the status of the Deferal (running, paused, stopped).
+ */
+template <class Clock>
+deferal_status_t
+BasicDeferal<Clock>::status()
+{
+    updateStatus();
+    return (deferal_status_t) status_;
+}
+
+/**
+ * @brief Pause a running deferal.
+ *
+ * A paused Deferal is removed from its wheel until it is resumed, so
+ * it adds nothing to the cost of checkDeferals().
+ */
+template <class Clock>
+void
+BasicDeferal<Clock>::pause()
+{
+    updateStatus();
+    if (status_ == DEFERAL_RUNNING) {
+	status_ = DEFERAL_PAUSED;
+	start_time_ = now() - start_time_;
+	removeDeferalEntry(this);
+    }
+}
+
+/**
+ * @brief Resume a paused deferal.
+ */
+template <class Clock>
+void
+BasicDeferal<Clock>::resume()
+{
+    if (status_ == DEFERAL_PAUSED) {
+	start_time_ = now() - start_time_;
+	status_ = DEFERAL_RUNNING;
+	addDeferalEntry(this);
+    }
+}
+
+/**
+ * @brief Repeat the last delay from the time of its completion.
+ *
+ * If the added delay still leaves us stopped, we may run any
+ * associated post Deferal function.  This only makes sense for
+ * Deferals that have stopped.
+ *
+ * An autorepeating Deferal that has missed whole periods resumes at
+ * its next period, with the post Deferal function being called for
+ * the missed periods according to its catch-up policy (see
+ * setCatchup()).  The number of missed periods is found by division,
+ * so catching up takes constant time apart from any calls.
+ */
+template <class Clock>
+void
+BasicDeferal<Clock>::again(unsigned long delay, bool run_post_fn)
+{
+    if (status_ == DEFERAL_STOPPED) {
+	deferal_tick_t this_delay = delay? delay: delay_time_;
+	deferal_tick_t missed;
+	deferal_tick_t calls;
+
+	// Set start_time_ to the time it would have automatically
+	// restarted, had it done so.
+	start_time_ += delay_time_;
+	delay_time_ = this_delay;
+	missed = periodsMissed(start_time_);
+	setMissed(missed);
+	if (missed) {
+#ifdef DEFERAL_STATS
+	    recordMissed(missed);
+#endif
+	    if (!autorepeat_) {
+		// There is no period to catch up with, so we call
+		// our post Deferal function once and are done.
+		calls = 1;
+	    }
+	    else {
+		start_time_ += missed * delay_time_;
+		switch (catchup_) {
+		case DEFERAL_CATCHUP_ONCE:
+		    calls = 1;
+		    break;
+		case DEFERAL_CATCHUP_SKIP:
+		    calls = 0;
+		    break;
+		case DEFERAL_CATCHUP_BURST:
+		    calls = (missed < burst_)? missed: burst_;
+		    break;
+		default:
+		    calls = missed;
+		}
+	    }
+	    if (run_post_fn && defer_fn_) {
+		status_ = DEFERAL_PROCESSING;
+		while (calls--) {
+		    callDeferFn();
+		}
+		status_ = DEFERAL_STOPPED;
+	    }
+	    if (!autorepeat_) {
+		return;
+	    }
+	}
+	status_ = DEFERAL_RUNNING;
+	addDeferalEntry(this);
+    }
+    else {
+	start(delay);
+    }
+}
+
+/**
+ * @brief Return the number of whole periods that would be missed by
+ * restarting the Deferal from a start time.
+ */
+template <class Clock>
+deferal_tick_t
+BasicDeferal<Clock>::periodsMissed(deferal_tick_t start)
+{
+    deferal_tick_t elapsed = now() - start;
+
+    // If elapsed > MAXINT/2 then the start time is in the future,
+    // and we have missed nothing.
+    if (delay_time_ && (elapsed > delay_time_) &&
+	(elapsed <= (DEFERAL_TICK_MAX >> 1))) {
+	// Running again still leaves the finish time in the past
+	return (deferal_tick_t) (elapsed - 1) / delay_time_;
+    }
+    return 0;
+}
+
+/**
+ * @brief Record the number of missed periods, saturating at 65535.
+ */
+template <class Clock>
+void
+BasicDeferal<Clock>::setMissed(deferal_tick_t missed)
+{
+#if defined(DEFERAL_TICK_BITS) && (DEFERAL_TICK_BITS == 16)
+    missed_ = missed;
+#else
+    missed_ = (missed > 0xffff)? 0xffff: missed;
+#endif
+}
+
+/**
+ * @brief Allow the Deferal to be reported as expired up to slack
+ * clock units after its expiry time.
+ *
+ * checkDeferals() and drainExpired() will report the Deferal at the
+ * time within [expiry time, expiry time + slack] that is the
+ * multiple of the largest possible power of 2.  Deferals whose
+ * windows overlap will therefore usually be reported together,
+ * reducing the number of times that there is work to do.  Status
+ * checks, such as running(), still see the Deferal expire at its
+ * expiry time.
+ *
+ * @param slack  The tolerance, which is limited to DEFERAL_MAX_SLACK:
+ * 65535, or 16383 with 16 bit ticks.
+ */
+template <class Clock>
+void
+BasicDeferal<Clock>::setSlack(unsigned long slack)
+{
+    slack_ = (slack > DEFERAL_MAX_SLACK)? DEFERAL_MAX_SLACK: slack;
+    if (status_ == DEFERAL_RUNNING) {
+	addDeferalEntry(this);
+    }
+}
+
+/**
+ * @brief Set whether restarting a running Deferal, if it only delays
+ * its expiry, leaves it in place in the wheel (see start()).
+ *
+ * A running Deferal that is no longer to be restarted lazily is
+ * placed again, as it may have been left in a slot before its expiry
+ * time.
+ */
+template <class Clock>
+void
+BasicDeferal<Clock>::setLazyRestart(bool lazy)
+{
+    if (lazy_ && !lazy && (status_ == DEFERAL_RUNNING)) {
+	addDeferalEntry(this);
+    }
+    lazy_ = lazy;
+}
+
+/**
+ * @brief Set how an autorepeating Deferal catches up on periods
+ * that it has missed.
+ *
+ * @param policy  The catch-up policy.  The default,
+ * DEFERAL_CATCHUP_ALL, calls the post Deferal function for every
+ * missed period.
+ * @param burst  For DEFERAL_CATCHUP_BURST, the most calls to make
+ * for missed periods, from 1 to DEFERAL_MAX_BURST, the default.  A
+ * burst of 0 is taken as 1; use DEFERAL_CATCHUP_SKIP for no calls.
+ */
+template <class Clock>
+void
+BasicDeferal<Clock>::setCatchup(deferal_catchup_t policy, unsigned burst)
+{
+    catchup_ = policy;
+    burst_ = (burst > DEFERAL_MAX_BURST)? DEFERAL_MAX_BURST:
+	(burst? burst: 1);
+}
+
+/**
+ * @brief Return the outstanding delay amount at the current time.
+ * Note that this may be negative if the delay has expired and not
+ * restarted.  For a paused Deferal, this is the delay that will
+ * remain when it is resumed.
+ */
+template <class Clock>
+long
+BasicDeferal<Clock>::remaining()
+{
+    deferal_tick_t elapsed = (status_ == DEFERAL_PAUSED)?
+	start_time_: (deferal_tick_t) (now() - start_time_);
+    return (deferal_stick_t) (deferal_tick_t) (delay_time_ - elapsed);
+}
+
+/**
+ * @brief Set the function to be run when the Deferal expires.
+ *
+ * @param fn  The function to be called on completion of our delay.
+ * @param param  A parameter to be passed to the above function on
+ * completion of our delay.
+ */
+template <class Clock>
+void
+BasicDeferal<Clock>::setDeferalFn(PostDeferalFn fn, void *param)
+{
+    defer_fn_ = fn;
+    defer_fn_param_ = param;
+}
+
+/**
+ * @brief Set a lambda or other functor to be run when the Deferal
+ * expires.
+ *
+ *     Deferal retry(500, false, false);
+ *     retry.setDeferalFn([conn]() { conn->resend(); });
+ *
+ * The functor is copied into the Deferal, without using the heap, so
+ * it must be trivially copyable and trivially destructible: a lambda
+ * may capture pointers, references and plain values, but not, for
+ * instance, a String.  A functor no bigger than a pointer is stored
+ * in place of the parameter; a larger one needs DEFERAL_FN_SIZE
+ * bytes of space in each Deferal.  A functor too big for either is a
+ * compile-time error.  Calling the functor costs the same single
+ * indirect call as calling a PostDeferalFn.
+ *
+ * @param fn  The functor, taking no arguments.
+ */
+template <class Clock>
+template <class F, class>
+void
+BasicDeferal<Clock>::setDeferalFn(F fn)
+{
+    static_assert(__is_trivially_copyable(F) && DEFERAL_TRIVIAL_DTOR(F),
+		  "Deferal functors must be trivially copyable and destructible");
+    static_assert(sizeof(F) <= sizeof(void *) ||
+		  sizeof(F) <= DEFERAL_FN_SIZE,
+		  "Deferal functor captures too much: increase DEFERAL_FN_SIZE");
+    static_assert(alignof(F) <= alignof(void *),
+		  "Deferal functors must not need more than pointer alignment");
+
+    if (sizeof(F) <= sizeof(void *)) {
+	defer_fn_param_ = NULL;
+	memcpy(&defer_fn_param_, &fn, sizeof(F));
+	defer_fn_ = invokeParam<F>;
+    }
+#if DEFERAL_FN_SIZE > 0
+    else {
+	memcpy(fn_storage_, &fn, sizeof(F));
+	defer_fn_param_ = fn_storage_;
+	defer_fn_ = invokeStored<F>;
+    }
+#endif
+}
+
+/**
+ * @brief Call a functor stored in place of the parameter.
+ */
+template <class Clock>
+template <class F>
+void
+BasicDeferal<Clock>::invokeParam(void *param)
+{
+    alignas(F) unsigned char fn[sizeof(F)];
+
+    memcpy(fn, &param, sizeof(F));
+    (*(F *) fn)();
+}
+
+/**
+ * @brief Call a functor stored in DeferalBase#fn_storage_.
+ */
+template <class Clock>
+template <class F>
+void
+BasicDeferal<Clock>::invokeStored(void *storage)
+{
+    (*(F *) storage)();
+}
+
+/**
+ * @brief Return the delay period for this Deferal.
+ */
+template <class Clock>
+long
+BasicDeferal<Clock>::delayPeriod()
+{
+    return delay_time_;
+}
+
+/**
+ * @brief Set the delay period for this Deferal.
+ *
+ * @param delay  The delay for our deferred operation, based on the
+ * units of our clock.
+ */
+template <class Clock>
+void
+BasicDeferal<Clock>::setDelay(unsigned long delay)
+{
+    delay_time_ = delay;
+    if (status_ == DEFERAL_RUNNING) {
+	addDeferalEntry(this);
+    }
+}
+
+/**
+ * @brief Set the offset period for the first expiry of this Deferal.
+ *
+ * This should be set immediately after creating the Deferal or
+ * setting a delay.  This allows us to start a repeating delay with
+ * the first delay expiring sooner or later than the delay period.
+ * This allows us, for example, to set a heartbeat interval of one
+ * minute, with the first heartbeat occurring 30 seconds from now.
+ *
+ * @param offset  The delay for the first expiry of this Deferal
+ * in units of our clock.  This has no effect on a paused Deferal.
+ */
+template <class Clock>
+void
+BasicDeferal<Clock>::setOffset(unsigned long offset)
+{
+    if (status_ == DEFERAL_PAUSED) {
+	return;
+    }
+    start_time_ = expiryTime() - offset;
+    if (status_ == DEFERAL_RUNNING) {
+	addDeferalEntry(this);
+    }
+}
+
+
+#ifdef UNIT_TESTING
+/**
+ * @brief Reset the wheels for our clock type to be empty.
+ */
+template <class Clock>
+void
+BasicDeferal<Clock>::clearDeferals()
+{
+    endTick();
+    for (DeferalWheel *wheel = Clock::wheels(); wheel; wheel = wheel->next_) {
+	wheel->clear();
+    }
+}
+
+template <class Clock>
+void
+BasicDeferal<Clock>::reset(unsigned long delay, bool autorepeat,
+			   bool start, Clock clock)
+{
+    removeDeferalEntry(this);
+    Clock::operator=(clock);
+    init(delay, autorepeat, start);
+}
+#endif
+
+/**
+ * @brief A handle to a Deferal in a DeferalPool.
+ *
+ * This holds the index of the Deferal's slot in the low 16 bits, and
+ * the slot's generation in the high 16 bits, so that a handle to a
+ * Deferal that has been released is detected.  No valid handle is 0.
+ */
+typedef uint32_t deferal_handle_t;
+
+/**
+ * @brief The handle returned when a DeferalPool is full.
+ */
+#define DEFERAL_NULL_HANDLE ((deferal_handle_t) 0)
+
+/**
+ * @class DeferalPool
+ * @brief Storage for up to N Deferals, allocated without the heap.
+ *
+ * Rather than creating Deferals with new, which fragments the heap
+ * of a microcontroller and scatters Deferals through memory, they may
+ * be created in a pool, which keeps them together in a single array.
+ * Creating and releasing a Deferal each take constant time.
+ *
+ *     static DeferalPool<32> timers;
+ *     ...
+ *     deferal_handle_t h = timers.create(500, &on_timeout, conn);
+ *     ...
+ *     if (Deferal *timeout = timers.get(h)) {
+ *         timeout->start();
+ *     }
+ *     timers.release(h);
+ *
+ * Each slot has a generation, which changes whenever its Deferal is
+ * released, so that a stale handle, kept after its Deferal was
+ * released, is detected by get() and release() rather than reaching
+ * another Deferal that has since reused the slot.  The generation is
+ * 15 bits, so a stale handle is only mistaken for a new one after its
+ * slot has been reused 32768 times.
+ *
+ * A Deferal must not be released from its own post Deferal function.
+ *
+ * @tparam N  The number of Deferals, at most 65535.
+ * @tparam D  The type of Deferal, by default Deferal.
+ */
+template <unsigned N, class D = Deferal>
+class DeferalPool {
+    static_assert(N > 0 && N <= 0xffff, "DeferalPool size must be 1..65535");
+
+  public:
+    DeferalPool(): free_(N), unused_(0), in_use_(0), high_water_(0) {}
+    ~DeferalPool();
+
+    template <class... Args>
+    deferal_handle_t create(Args... args);
+    D *get(deferal_handle_t handle);
+    bool release(deferal_handle_t handle);
+
+    /// Return the number of Deferals that may be in the pool.
+    static unsigned capacity() { return N; }
+    /// Return the number of Deferals in the pool.
+    unsigned inUse() { return in_use_; }
+    /// Return the most Deferals that have been in the pool at once.
+    unsigned highWater() { return high_water_; }
+
+  protected:
+    /// Return the Deferal in a slot.
+    D *slot(unsigned index) { return (D *) storage_[index]; }
+
+    /// The Deferals.
+    alignas(D) unsigned char storage_[N][sizeof(D)];
+
+    /// The generation of each slot, which is odd while the slot is
+    /// in use.  Only slots below #unused_ have been initialised.
+    uint16_t generation_[N];
+
+    /// For each free slot, the next free slot, or N.
+    uint16_t next_free_[N];
+
+    /// The first of the released slots, or N.
+    unsigned free_;
+
+    /// The number of slots that have ever been used.  Slots from
+    /// here on are free, and are used in order before the released
+    /// slots, so that the pool needs no initialisation.
+    unsigned unused_;
+
+    /// The number of slots in use.
+    unsigned in_use_;
+
+    /// The greatest value of #in_use_.
+    unsigned high_water_;
+};
+
+/**
+ * @brief Release every Deferal remaining in the pool.
+ */
+template <unsigned N, class D>
+DeferalPool<N, D>::~DeferalPool()
+{
+    for (unsigned i = 0; i < unused_; i++) {
+	if (generation_[i] & 1) {
+	    slot(i)->~D();
+	}
+    }
+}
+
+/**
+ * @brief Create a Deferal in the pool.
+ *
+ * @param args  The arguments for the Deferal's constructor.
+ * @result A handle to the new Deferal, or DEFERAL_NULL_HANDLE if the
+ * pool is full.
+ */
+template <unsigned N, class D>
+template <class... Args>
+deferal_handle_t
+DeferalPool<N, D>::create(Args... args)
+{
+    unsigned index;
+
+    if (unused_ < N) {
+	index = unused_++;
+	generation_[index] = 0;
+    }
+    else if (free_ < N) {
+	index = free_;
+	free_ = next_free_[index];
+    }
+    else {
+	return DEFERAL_NULL_HANDLE;
+    }
+    generation_[index] = (generation_[index] + 1) | 1;
+    if (++in_use_ > high_water_) {
+	high_water_ = in_use_;
+    }
+    new (storage_[index]) D(args...);
+    return ((deferal_handle_t) generation_[index] << 16) | index;
+}
+
+/**
+ * @brief Return the Deferal identified by a handle.
+ *
+ * @result The Deferal, or NULL if the handle is invalid or the
+ * Deferal has been released.
+ */
+template <unsigned N, class D>
+D *
+DeferalPool<N, D>::get(deferal_handle_t handle)
+{
+    unsigned index = handle & 0xffff;
+
+    // A free slot's generation is even, and may have wrapped round to
+    // that of DEFERAL_NULL_HANDLE.
+    if (index >= unused_ || !(generation_[index] & 1)
+	|| generation_[index] != (handle >> 16)) {
+	return NULL;
+    }
+    return slot(index);
+}
+
+/**
+ * @brief Destroy the Deferal identified by a handle, stopping it
+ * without running its post Deferal function, and free its slot.
+ *
+ * @result false if the handle is invalid or its Deferal has already
+ * been released.
+ */
+template <unsigned N, class D>
+bool
+DeferalPool<N, D>::release(deferal_handle_t handle)
+{
+    unsigned index = handle & 0xffff;
+
+    if (!get(handle)) {
+	return false;
+    }
+    slot(index)->~D();
+    generation_[index]++;
+    next_free_[index] = free_;
+    free_ = index;
+    in_use_--;
+    return true;
+}
+
+/**
+ * @brief Find the first deadline that has been reached, for
+ * DeferalTable.
+ */
+extern unsigned deferalFindExpired(const deferal_tick_t *deadlines,
+				   unsigned from, unsigned count,
+				   deferal_tick_t now);
+
+/**
+ * @class DeferalTable
+ * @brief A table of up to N simple timers, expired by scanning their
+ * deadlines.
+ *
+ * Where there are many short-lived timers, which rarely need more
+ * than a deadline, a callback and a parameter, a DeferalTable may be
+ * used in place of Deferals.  The deadlines of running timers are
+ * kept together in a single array, apart from their callbacks, so
+ * that drainExpired() can find those that are due by comparing many
+ * deadlines at once, rather than visiting each timer in turn.
+ *
+ * Timers are identified by an id from 0 to N - 1, chosen by the
+ * caller, such as the number of a connection:
+ *
+ *     static DeferalTable<64> timeouts;
+ *     ...
+ *     timeouts.setDeferalFn(conn_id, &on_timeout, conn);
+ *     timeouts.start(conn_id, 500);
+ *     ...
+ *     timeouts.drainExpired();
+ *
+ * Starting a timer that is already running changes its deadline
+ * where it lies in the table.  Running timers are kept at the front
+ * of the table, so each scan costs time in proportion to the number
+ * running, rather than to N, but, unlike checkDeferals(), scans every
+ * running timer whether or not any is due.  Timers that expire in the
+ * same call to drainExpired() are run in the order they lie in the
+ * table, rather than in order of their deadlines.
+ *
+ * A timer's callback may start and stop any timers in the table, but
+ * must not call drainExpired().
+ *
+ * @tparam N  The number of timers.
+ */
+template <unsigned N>
+class DeferalTable {
+    static_assert(N > 0 && N < UINT_MAX, "DeferalTable size must be positive");
+
+  public:
+    /// Create a table whose timers use timer_fn, by default millis().
+    DeferalTable(TimerFn timer_fn = millis):
+	timer_fn_(timer_fn), count_(0), scan_(0) {
+	for (unsigned id = 0; id < N; id++) {
+	    position_[id] = N;
+	    fn_[id] = NULL;
+	}
+    }
+
+    void setDeferalFn(unsigned id, PostDeferalFn fn, void *param = NULL);
+    void start(unsigned id, unsigned long delay, bool autorepeat = false);
+    void stop(unsigned id, bool run_post_fn = true);
+    unsigned long remaining(unsigned id);
+    unsigned drainExpired();
+
+    /// Return whether a timer is running.
+    bool running(unsigned id) { return position_[id] < N; }
+    /// Return the number of running timers.
+    unsigned count() { return count_; }
+    /// Return the number of timers in the table.
+    static unsigned capacity() { return N; }
+
+  protected:
+    void remove(unsigned position);
+    void move(unsigned from, unsigned to);
+
+    /// The deadlines of the running timers, at positions below
+    /// #count_.  This is all that is read in a scan for expired
+    /// timers.
+    alignas(32) deferal_tick_t deadline_[N];
+
+    /// The id of the timer at each position below #count_.
+    unsigned id_[N];
+
+    /// The position of each timer in #deadline_, or N if it is not
+    /// running.
+    unsigned position_[N];
+
+    /// The callback for each timer.
+    PostDeferalFn fn_[N];
+
+    /// The parameter for each timer's callback.
+    void *param_[N];
+
+    /// The period of each autorepeating timer, or 0.
+    deferal_tick_t period_[N];
+
+    TimerFn timer_fn_;
+
+    /// The number of running timers.
+    unsigned count_;
+
+    /// While drainExpired() is running, the positions below this
+    /// have been scanned.
+    unsigned scan_;
+};
+
+/**
+ * @brief Set the function, and its parameter, to be called when a
+ * timer expires.
+ */
+template <unsigned N>
+void
+DeferalTable<N>::setDeferalFn(unsigned id, PostDeferalFn fn, void *param)
+{
+    fn_[id] = fn;
+    param_[id] = param;
+}
+
+/**
+ * @brief Start a timer, or restart it if it is already running,
+ * which takes constant time.
+ *
+ * @param delay  The delay from now until the timer expires.
+ * @param autorepeat  Whether the timer restarts each time it expires,
+ * delay after its previous deadline.
+ */
+template <unsigned N>
+void
+DeferalTable<N>::start(unsigned id, unsigned long delay, bool autorepeat)
+{
+    unsigned position = position_[id];
+
+    if (position == N) {
+	position = count_++;
+	position_[id] = position;
+	id_[position] = id;
+    }
+    deadline_[position] = (deferal_tick_t) (timer_fn_() + delay);
+    period_[id] = autorepeat? (deferal_tick_t) delay: 0;
+}
+
+/**
+ * @brief Stop a timer, calling its function unless run_post_fn is
+ * false, as Deferal::stop() does.  Stopping a timer that is not
+ * running does nothing.
+ */
+template <unsigned N>
+void
+DeferalTable<N>::stop(unsigned id, bool run_post_fn)
+{
+    if (position_[id] < N) {
+	remove(position_[id]);
+	if (run_post_fn && fn_[id]) {
+	    fn_[id](param_[id]);
+	}
+    }
+}
+
+/**
+ * @brief Return the time until a timer expires, or 0 if it is due or
+ * not running.
+ */
+template <unsigned N>
+unsigned long
+DeferalTable<N>::remaining(unsigned id)
+{
+    if (position_[id] < N) {
+	deferal_stick_t left = (deferal_stick_t) (deferal_tick_t)
+	    (deadline_[position_[id]] - (deferal_tick_t) timer_fn_());
+	if (left > 0) {
+	    return (unsigned long) left;
+	}
+    }
+    return 0;
+}
+
+/**
+ * @brief Expire every running timer that is due, calling its
+ * function, and restarting it if it autorepeats.
+ *
+ * The time is read once, before the scan.  An autorepeating timer
+ * that has fallen more than a period behind expires once in each
+ * call.
+ *
+ * @result The number of timers that expired.
+ */
+template <unsigned N>
+unsigned
+DeferalTable<N>::drainExpired()
+{
+    deferal_tick_t now = (deferal_tick_t) timer_fn_();
+    unsigned expired = 0;
+
+    scan_ = 0;
+    while ((scan_ = deferalFindExpired(deadline_, scan_, count_, now))
+	   < count_) {
+	unsigned id = id_[scan_];
+	if (period_[id]) {
+	    deadline_[scan_] += period_[id];
+	    scan_++;
+	}
+	else {
+	    // The last timer takes this position, which remains to be
+	    // scanned.
+	    remove(scan_);
+	}
+	expired++;
+	if (fn_[id]) {
+	    fn_[id](param_[id]);
+	}
+    }
+    scan_ = 0;
+    return expired;
+}
+
+/**
+ * @brief Remove the timer at a position from the running timers, in
+ * constant time, by moving the last running timer into its place.
+ *
+ * If the position has already been scanned by drainExpired(), the
+ * last scanned timer is moved into it instead, and the last timer
+ * into the place of that, so that the last timer is still scanned.
+ */
+template <unsigned N>
+void
+DeferalTable<N>::remove(unsigned position)
+{
+    position_[id_[position]] = N;
+    count_--;
+    if (position < scan_) {
+	scan_--;
+	move(scan_, position);
+	position = scan_;
+    }
+    move(count_, position);
+}
+
+/**
+ * @brief Move a running timer from one position to another.
+ */
+template <unsigned N>
+void
+DeferalTable<N>::move(unsigned from, unsigned to)
+{
+    if (from != to) {
+	deadline_[to] = deadline_[from];
+	id_[to] = id_[from];
+	position_[id_[to]] = to;
+    }
+}
+
+#ifdef DEFERAL_COROUTINES
+/**
+ * @brief The number of coroutine frames in the pool used by
+ * DeferalTask.
+ */
+#ifndef DEFERAL_TASK_FRAMES
+#define DEFERAL_TASK_FRAMES 16
+#endif
+
+/**
+ * @brief The size of each coroutine frame in the pool used by
+ * DeferalTask.  A coroutine whose frame is larger cannot be started.
+ *
+ * Each co_await of deferalSleepFor() needs around 100 bytes of the
+ * frame, as the compiler does not share space between awaiters.  The
+ * pool takes DEFERAL_TASK_FRAMES * DEFERAL_TASK_FRAME_SIZE bytes, so
+ * both should be reduced for small microcontrollers.
+ */
+#ifndef DEFERAL_TASK_FRAME_SIZE
+#define DEFERAL_TASK_FRAME_SIZE 512
+#endif
+
+/**
+ * @class DeferalTask
+ * @brief The return type of a coroutine that waits on Deferals.
+ *
+ * Sequential logic, that would otherwise be a state machine driven by
+ * post Deferal functions, can be written as a coroutine:
+ *
+ *     DeferalTask blink(int pin) {
+ *         for (int i = 0; i < 3; i++) {
+ *             digitalWrite(pin, HIGH);
+ *             co_await deferalSleepFor(100);
+ *             digitalWrite(pin, LOW);
+ *             co_await deferalSleepFor(400);
+ *         }
+ *     }
+ *
+ * Calling the coroutine runs it until its first co_await; it is then
+ * resumed by the main loop's calls to Deferal::checkDeferals() or
+ * Deferal::drainExpired(), and its frame is released when it
+ * returns.  Frames come from a fixed pool of DEFERAL_TASK_FRAMES,
+ * each of DEFERAL_TASK_FRAME_SIZE bytes, so the heap is never used.
+ * The pool is shared by all threads.
+ * If the pool is exhausted, or the frame is too big, the coroutine
+ * does not run, and valid() returns false.
+ *
+ * This is only available if DEFERAL_COROUTINES is defined.
+ */
+class DeferalTask {
+  public:
+    /**
+     * @brief The promise type for DeferalTask coroutines.
+     */
+    struct promise_type {
+	DeferalTask get_return_object() { return DeferalTask(true); }
+	static DeferalTask get_return_object_on_allocation_failure() {
+	    return DeferalTask(false);
+	}
+	std::suspend_never initial_suspend() noexcept { return {}; }
+	std::suspend_never final_suspend() noexcept { return {}; }
+	void return_void() {}
+	void unhandled_exception() { std::terminate(); }
+
+	static void *operator new(size_t size) noexcept {
+	    return allocFrame(size);
+	}
+	static void operator delete(void *frame) { freeFrame(frame); }
+    };
+
+    /// Predicate: true if the coroutine was started.
+    bool valid() { return valid_; }
+    static unsigned framesInUse();
+
+  protected:
+    DeferalTask(bool valid): valid_(valid) {}
+
+    static void *allocFrame(size_t size);
+    static void freeFrame(void *frame);
+
+    /// Whether the coroutine was started.
+    bool valid_;
+};
+
+/**
+ * @class DeferalSleep
+ * @brief The awaiter returned by deferalSleepFor().
+ *
+ * This contains the Deferal used to time the sleep, so it lives in
+ * the coroutine's frame.
+ */
+class DeferalSleep: public DeferalAwaiter {
+  public:
+    DeferalSleep(unsigned long delay, TimerFn timer_fn):
+	deferal_(delay, readyFn, this, false, false, timer_fn) {}
+
+    /// Predicate: true if there is no need to wait.
+    bool await_ready() { return deferal_.delayPeriod() == 0; }
+    /// Start the Deferal that will resume the coroutine.
+    void await_suspend(std::coroutine_handle<> handle) {
+	handle_ = handle;
+	deferal_.start();
+    }
+    void await_resume() {}
+
+  protected:
+    /// The Deferal that times the sleep.
+    Deferal deferal_;
+};
+
+/**
+ * @brief Suspend the calling DeferalTask coroutine for a delay.
+ *
+ *     co_await deferalSleepFor(100);
+ *
+ * @param delay  The delay, in units of timer_fn.
+ * @param timer_fn  The timer function for the delay, by default
+ * millis().
+ */
+inline DeferalSleep
+deferalSleepFor(unsigned long delay, TimerFn timer_fn = millis)
+{
+    return DeferalSleep(delay, timer_fn);
+}
+
+/**
+ * @class DeferalWait
+ * @brief The awaiter for co_await on a Deferal, which suspends the
+ * coroutine until the Deferal next expires.
+ *
+ * While the coroutine waits, the Deferal's post Deferal function is
+ * replaced by our own, which restores and calls the original.  This
+ * is called by the polling thread even if a DeferalExecutor is set,
+ * so that the coroutine is resumed by that thread.  If the
+ * Deferal is not running, the coroutine does not wait.  The Deferal
+ * must not be stopped without running its post Deferal function, nor
+ * destroyed, while a coroutine waits on it.
+ */
+class DeferalWait: public DeferalAwaiter {
+  public:
+    DeferalWait(Deferal &deferal): deferal_(&deferal) {}
+
+    /// Predicate: true if the Deferal is not running.
+    bool await_ready() { return !deferal_->running(); }
+    void await_suspend(std::coroutine_handle<> handle) {
+	handle_ = handle;
+	fn_ = deferal_->defer_fn_;
+	param_ = deferal_->defer_fn_param_;
+	deferal_->defer_fn_ = waitFn;
+	deferal_->defer_fn_param_ = this;
+    }
+    void await_resume() {}
+
+  protected:
+    friend class DeferalAwaiter;
+    static void waitFn(void *awaiter);
+
+    /// The Deferal that we wait for.
+    Deferal *deferal_;
+
+    /// The Deferal's own post Deferal function, and its parameter.
+    PostDeferalFn fn_;
+    void *param_;
+};
+
+/**
+ * @brief Allow a DeferalTask coroutine to wait for a Deferal to
+ * expire, with co_await.
+ */
+inline DeferalWait
+operator co_await(Deferal &deferal)
+{
+    return DeferalWait(deferal);
+}
+#endif
+
+extern template class BasicDeferal<TimerFnClock>;
+
 #endif
@@ -0,0 +1,745 @@
+/* Benchmarks for Deferals, using the Arduino.h stub from the unit
+ * tests.  Build and run from the top directory with:
+ *
+ *     g++ -O2 -Itests -I. tests/bench_Deferal.cpp Deferal.cpp \
+ *         -o bench_Deferal && ./bench_Deferal [max_timers]
+ *
+ * Timer counts are swept from 10 to max_timers (default 1000000).
+ * Each result is written as a single line of space-separated
+ * key=value pairs, so that results may be compared between builds:
+ *
+ *  - bench=clock compares the indirect call of the timer function
+ *    for Deferal with the inlined call for MillisDeferal;
+ *  - bench=arm measures start() and stop() of running Deferals;
+ *  - bench=restart measures idle timeouts, each restarted on every
+ *    tick of simulated time and polled with drainExpired(), with and
+ *    without setLazyRestart();
+ *  - bench=poll measures checkDeferals() over a period of simulated
+ *    time, for different distributions of delays, proportions of
+ *    expiries that restart their Deferals, and callback costs;
+ *  - bench=catchup measures again() for autorepeating Deferals that
+ *    have fallen many periods behind, for each catch-up policy;
+ *  - bench=pool compares creating, polling and destroying n Deferals
+ *    in a DeferalPool with doing so with new and delete, for n up to
+ *    10000;
+ *  - bench=table compares polling n short-lived Deferals, each
+ *    restarted with a new delay when it expires, with checkDeferals()
+ *    against doing so with the timers of a DeferalTable and
+ *    drainExpired();
+ *  - bench=callable compares draining Deferals whose expiry calls a
+ *    PostDeferalFn with those that call a capturing lambda;
+ *  - bench=producers, only if built with -DDEFERAL_THREADS -pthread,
+ *    measures startAsync() and stopAsync() from 1 to 8 producer
+ *    threads, each with its own Deferals, while the main thread
+ *    dispatches;
+ *  - bench=shards, also only with DEFERAL_THREADS, measures restarts
+ *    and polls from 1 to 8 threads, each owning a DeferalShard with
+ *    its share of the Deferals;
+ *  - bench=executor, also only with DEFERAL_THREADS, measures
+ *    draining Deferals with costly callbacks run by the poller
+ *    (workers=0) or by a DeferalExecutor, giving the time the poller
+ *    spends, the callback throughput and the dispatch latency.
+ *
+ * allocs is the number of calls to operator new during the timed
+ * part of each benchmark.
+ */
+
+#include <Deferal.h>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <string.h>
+#include <vector>
+#ifdef DEFERAL_THREADS
+#include <thread>
+#endif
+
+static unsigned long milli_count = 0;
+
+unsigned long
+millis(void)
+{
+    return milli_count;
+}
+
+static std::atomic<unsigned long> allocs(0);
+
+void *
+operator new(size_t size)
+{
+    allocs.fetch_add(1, std::memory_order_relaxed);
+    void *p = malloc(size? size: 1);
+    if (!p) {
+	throw std::bad_alloc();
+    }
+    return p;
+}
+
+void
+operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void
+operator delete(void *p, size_t size) noexcept
+{
+    free(p);
+}
+
+static double
+nowNs()
+{
+    return std::chrono::duration<double, std::nano>(
+	std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/* A simple, repeatable, random number generator, so that each run
+ * of the benchmarks does the same work. */
+static unsigned long rand_state = 1;
+
+static unsigned long
+nextRand()
+{
+    rand_state = rand_state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return (unsigned long) (rand_state >> 33);
+}
+
+/* Distributions of delays. */
+typedef enum {
+    DIST_SAME,        // Every delay is 500
+    DIST_UNIFORM,     // Uniform over 1..1000
+    DIST_SPREAD       // Log-uniform over 1..1000000
+} dist_t;
+
+static const char *dist_names[] = {"same", "uniform", "spread"};
+
+static unsigned long
+delayFor(dist_t dist)
+{
+    switch (dist) {
+    case DIST_SAME:
+	return 500;
+    case DIST_UNIFORM:
+	return 1 + nextRand() % 1000;
+    default:
+	return 1UL << (nextRand() % 20);
+    }
+}
+
+/* The simulated time for which each poll benchmark runs. */
+static unsigned long
+horizonFor(dist_t dist)
+{
+    return (dist == DIST_SPREAD)? 1UL << 20: 1000;
+}
+
+static volatile unsigned long spin_sink;
+
+/* Parameters for the callback of each polled Deferal. */
+static int callback_cost = 0;
+static int restart_percent = 0;
+static unsigned long expiries = 0;
+
+static void
+pollCallback(void *param)
+{
+    for (int i = 0; i < callback_cost; i++) {
+	spin_sink = spin_sink + i;
+    }
+    expiries++;
+    if ((int) (nextRand() % 100) < restart_percent) {
+	((Deferal *) param)->start();
+    }
+}
+
+/* Compare the cost of the timer function call, made through a
+ * function pointer for Deferal and inlined for MillisDeferal, by
+ * checking the status of n running Deferals, restarting them, and
+ * polling as they expire. */
+template <class D>
+static void
+benchClock(const char *clock, unsigned long n)
+{
+    std::vector<D *> deferals;
+    unsigned long i;
+    unsigned long running = 0;
+    unsigned long polls = 0;
+    double start;
+
+    milli_count = 0;
+    for (i = 0; i < n; i++) {
+	deferals.push_back(new D(1 + (i % 1000)));
+    }
+
+    start = nowNs();
+    for (int pass = 0; pass < 10; pass++) {
+	for (i = 0; i < n; i++) {
+	    running += deferals[i]->running();
+	}
+    }
+    double status_ns = nowNs() - start;
+
+    start = nowNs();
+    for (i = 0; i < n; i++) {
+	deferals[i]->start();
+    }
+    double start_ns = nowNs() - start;
+
+    start = nowNs();
+    for (milli_count = 1; milli_count <= 1000; milli_count++) {
+	while (D::checkDeferals()) {
+	    polls++;
+	}
+	polls++;
+    }
+    double poll_ns = nowNs() - start;
+
+    printf("bench=clock clock=%s n=%lu ns_per_status=%.2f "
+	   "ns_per_start=%.2f ns_per_poll=%.2f\n",
+	   clock, n, status_ns / (10 * n), start_ns / n, poll_ns / polls);
+
+    for (i = 0; i < n; i++) {
+	delete deferals[i];
+    }
+    if (running != 10 * n) {
+	fprintf(stderr, "unexpected running count %lu\n", running);
+    }
+}
+
+/* Measure starting (arming) and stopping (disarming) n Deferals,
+ * some of them repeatedly, as happens with timeouts that are
+ * restarted on each event. */
+static void
+benchArm(unsigned long n, dist_t dist)
+{
+    std::vector<Deferal *> deferals;
+    std::vector<unsigned long> delays;
+    unsigned long i;
+    unsigned long ops = 4 * n;
+    double start;
+
+    milli_count = 0;
+    rand_state = 1;
+    for (i = 0; i < n; i++) {
+	deferals.push_back(new Deferal(1, false, false));
+	delays.push_back(delayFor(dist));
+    }
+
+    allocs = 0;
+    start = nowNs();
+    for (i = 0; i < ops; i++) {
+	unsigned long idx = i % n;
+	deferals[idx]->start(delays[idx] + (i & 7));
+    }
+    double arm_ns = nowNs() - start;
+
+    start = nowNs();
+    for (i = 0; i < n; i++) {
+	deferals[i]->stop(false);
+    }
+    double disarm_ns = nowNs() - start;
+
+    printf("bench=arm n=%lu dist=%s ns_per_arm=%.2f ns_per_disarm=%.2f "
+	   "allocs=%lu\n", n, dist_names[dist], arm_ns / ops, disarm_ns / n,
+	   allocs.load());
+
+    for (i = 0; i < n; i++) {
+	delete deferals[i];
+    }
+}
+
+/* Measure n idle timeouts of 1000 ticks, each restarted on every tick
+ * for 100 ticks, as for a connection that receives a packet every
+ * tick, with the wheel drained on each tick. */
+static void
+benchRestart(unsigned long n, bool lazy)
+{
+    std::vector<Deferal *> deferals;
+    unsigned long i;
+
+    milli_count = 0;
+    for (i = 0; i < n; i++) {
+	Deferal *deferal = new Deferal(1000);
+	deferal->setLazyRestart(lazy);
+	deferals.push_back(deferal);
+    }
+
+    allocs = 0;
+    double start = nowNs();
+    for (milli_count = 1; milli_count <= 100; milli_count++) {
+	for (i = 0; i < n; i++) {
+	    deferals[i]->start();
+	}
+	Deferal::drainExpired();
+    }
+    double restart_ns = nowNs() - start;
+
+    printf("bench=restart n=%lu lazy=%d ns_per_restart=%.2f allocs=%lu\n",
+	   n, lazy, restart_ns / (100 * n), allocs.load());
+
+    for (i = 0; i < n; i++) {
+	delete deferals[i];
+    }
+}
+
+/* Measure polling with checkDeferals(), once per tick of simulated
+ * time, while n Deferals expire. */
+static void
+benchPoll(unsigned long n, dist_t dist, int restart, int cost)
+{
+    std::vector<Deferal *> deferals;
+    unsigned long horizon = horizonFor(dist);
+    unsigned long polls = 0;
+    unsigned long i;
+    double start;
+
+    milli_count = 0;
+    rand_state = 1;
+    restart_percent = restart;
+    callback_cost = cost;
+    expiries = 0;
+    for (i = 0; i < n; i++) {
+	Deferal *deferal = new Deferal(delayFor(dist), pollCallback);
+	deferal->setDeferalFn(pollCallback, deferal);
+	deferals.push_back(deferal);
+    }
+
+    allocs = 0;
+    start = nowNs();
+    for (milli_count = 1; milli_count <= horizon; milli_count++) {
+	while (Deferal::checkDeferals()) {
+	    polls++;
+	}
+	polls++;
+    }
+    double poll_ns = nowNs() - start;
+
+    printf("bench=poll n=%lu dist=%s restart=%d cb=%d polls=%lu "
+	   "expiries=%lu ns_per_poll=%.2f ns_per_expiry=%.2f allocs=%lu\n",
+	   n, dist_names[dist], restart, cost, polls, expiries,
+	   poll_ns / polls, expiries? poll_ns / expiries: 0.0, allocs.load());
+
+    for (i = 0; i < n; i++) {
+	delete deferals[i];
+    }
+}
+
+static const unsigned POOL_SIZE = 10000;
+
+/* Compare Deferals in a DeferalPool with those allocated by new: the
+ * cost of creating and destroying them, and of draining them as
+ * they expire. */
+static void
+benchPool(unsigned long n, bool pooled)
+{
+    static DeferalPool<POOL_SIZE> pool;
+    static deferal_handle_t handles[POOL_SIZE];
+    static Deferal *deferals[POOL_SIZE];
+    unsigned long i;
+
+    milli_count = 0;
+    rand_state = 1;
+    allocs = 0;
+    double start = nowNs();
+    for (i = 0; i < n; i++) {
+	unsigned long delay = delayFor(DIST_UNIFORM);
+	if (pooled) {
+	    handles[i] = pool.create(delay, true);
+	}
+	else {
+	    deferals[i] = new Deferal(delay, true);
+	}
+    }
+    double create_ns = nowNs() - start;
+
+    start = nowNs();
+    for (milli_count = 1; milli_count <= 1000; milli_count++) {
+	Deferal::drainExpired();
+    }
+    double drain_ns = nowNs() - start;
+
+    start = nowNs();
+    for (i = 0; i < n; i++) {
+	if (pooled) {
+	    pool.release(handles[i]);
+	}
+	else {
+	    delete deferals[i];
+	}
+    }
+    double release_ns = nowNs() - start;
+
+    printf("bench=pool n=%lu alloc=%s ns_per_create=%.2f "
+	   "ns_per_release=%.2f drain_ns=%.0f allocs=%lu\n", n,
+	   pooled? "pool": "new", create_ns / n, release_ns / n, drain_ns,
+	   allocs.load());
+}
+
+static const unsigned TABLE_SIZE = 1000000;
+static DeferalTable<TABLE_SIZE> table;
+
+static void
+restartDeferal(void *deferal)
+{
+    expiries++;
+    ((Deferal *) deferal)->start(delayFor(DIST_UNIFORM));
+}
+
+static void
+restartTableTimer(void *id)
+{
+    expiries++;
+    table.start((unsigned) (uintptr_t) id, delayFor(DIST_UNIFORM));
+}
+
+/* Compare n short-lived Deferals, each restarted with a new delay as
+ * it expires, polled once per tick with checkDeferals(), with n
+ * timers in a DeferalTable polled with drainExpired(). */
+static void
+benchTable(unsigned long n, bool tabled)
+{
+    std::vector<Deferal *> deferals;
+    unsigned long i;
+
+    milli_count = 0;
+    rand_state = 1;
+    expiries = 0;
+    for (i = 0; i < n; i++) {
+	if (tabled) {
+	    table.setDeferalFn(i, restartTableTimer, (void *) (uintptr_t) i);
+	    table.start(i, delayFor(DIST_UNIFORM));
+	}
+	else {
+	    Deferal *deferal = new Deferal(delayFor(DIST_UNIFORM), restartDeferal);
+	    deferal->setDeferalFn(restartDeferal, deferal);
+	    deferals.push_back(deferal);
+	}
+    }
+
+    allocs = 0;
+    double start = nowNs();
+    for (milli_count = 1; milli_count <= 1000; milli_count++) {
+	if (tabled) {
+	    table.drainExpired();
+	}
+	else {
+	    while (Deferal::checkDeferals()) {
+	    }
+	}
+    }
+    double poll_ns = nowNs() - start;
+
+    printf("bench=table n=%lu engine=%s expiries=%lu ns_per_tick=%.0f "
+	   "ns_per_expiry=%.2f allocs=%lu\n", n, tabled? "table": "wheel",
+	   expiries, poll_ns / 1000, poll_ns / expiries, allocs.load());
+
+    for (i = 0; i < n; i++) {
+	if (tabled) {
+	    table.stop(i, false);
+	}
+	else {
+	    delete deferals[i];
+	}
+    }
+}
+
+static unsigned long callable_calls = 0;
+
+static void
+countCallable(void *count)
+{
+    (*(unsigned long *) count)++;
+}
+
+/* Compare the cost of expiring n Deferals that call a PostDeferalFn
+ * with those that call a lambda capturing the same pointer. */
+static void
+benchCallable(unsigned long n, bool lambda)
+{
+    std::vector<Deferal *> deferals;
+    unsigned long *count = &callable_calls;
+    unsigned long i;
+
+    milli_count = 0;
+    callable_calls = 0;
+    for (i = 0; i < n; i++) {
+	if (lambda) {
+	    deferals.push_back(new Deferal(1 + i % 1000,
+					   [count]() { (*count)++; }, true));
+	}
+	else {
+	    deferals.push_back(new Deferal(1 + i % 1000, countCallable,
+					   count, true));
+	}
+    }
+
+    allocs = 0;
+    double start = nowNs();
+    for (milli_count = 1; milli_count <= 1000; milli_count++) {
+	Deferal::drainExpired();
+    }
+    double drain_ns = nowNs() - start;
+
+    printf("bench=callable n=%lu fn=%s calls=%lu ns_per_call=%.2f "
+	   "allocs=%lu\n", n, lambda? "lambda": "pointer", callable_calls,
+	   drain_ns / callable_calls, allocs.load());
+
+    for (i = 0; i < n; i++) {
+	delete deferals[i];
+    }
+}
+
+static const char *catchup_names[] = {"all", "once", "skip", "burst"};
+
+/* Measure again() catching up autorepeating Deferals that have
+ * missed many periods, as after a long blocking operation. */
+static void
+benchCatchup(unsigned long n, unsigned long missed, deferal_catchup_t policy)
+{
+    std::vector<Deferal *> deferals;
+    unsigned long i;
+    double start;
+
+    milli_count = 0;
+    callback_cost = 0;
+    restart_percent = 0;
+    expiries = 0;
+    for (i = 0; i < n; i++) {
+	deferals.push_back(new Deferal(10, pollCallback, NULL, true));
+	deferals[i]->setCatchup(policy, 4);
+    }
+
+    milli_count = 10 * missed;
+    allocs = 0;
+    start = nowNs();
+    int drained = Deferal::drainExpired();
+    double drain_ns = nowNs() - start;
+
+    printf("bench=catchup n=%lu missed=%lu policy=%s drained=%d "
+	   "callbacks=%lu ns_per_deferal=%.2f allocs=%lu\n", n, missed,
+	   catchup_names[policy], drained, expiries, drain_ns / n,
+	   allocs.load());
+
+    for (i = 0; i < n; i++) {
+	delete deferals[i];
+    }
+}
+
+#ifdef DEFERAL_THREADS
+/* Measure arming and cancelling Deferals from producer threads.  Each
+ * producer alternately starts and stops each of n Deferals of its
+ * own, while the main thread applies their commands.  For linear
+ * scaling, throughput should rise in proportion to the number of
+ * producers, as long as each has a core of its own. */
+static void
+benchProducers(unsigned long n, int producers)
+{
+    const unsigned long ops = 1000000;
+    std::vector<Deferal *> deferals;
+    std::vector<std::thread> threads;
+    std::atomic<int> done(0);
+    unsigned long polls = 0;
+
+    milli_count = 0;
+    for (unsigned long i = 0; i < n * producers; i++) {
+	deferals.push_back(new Deferal(1000, false, false));
+    }
+
+    double start = nowNs();
+    for (int t = 0; t < producers; t++) {
+	threads.push_back(std::thread([&, t]() {
+	    Deferal **mine = &deferals[t * n];
+	    for (unsigned long i = 0; i < ops; i += 2) {
+		Deferal *deferal = mine[(i / 2) % n];
+		deferal->startAsync(1 + (i & 1023));
+		deferal->stopAsync(false);
+	    }
+	    done++;
+	}));
+    }
+    while (done < producers) {
+	Deferal::applyAsyncCommands();
+	polls++;
+    }
+    for (int t = 0; t < producers; t++) {
+	threads[t].join();
+    }
+    double elapsed_ns = nowNs() - start;
+    Deferal::applyAsyncCommands();
+
+    printf("bench=producers n=%lu producers=%d polls=%lu "
+	   "ns_per_op=%.2f mops_per_sec=%.2f\n", n, producers, polls,
+	   elapsed_ns / (ops * producers), ops * producers * 1000.0 / elapsed_ns);
+
+    for (unsigned long i = 0; i < n * producers; i++) {
+	delete deferals[i];
+    }
+}
+
+static thread_local unsigned long shard_count = 0;
+
+static unsigned long
+shardMillis(void)
+{
+    return shard_count;
+}
+
+/* Measure restarting Deferals, as for per-session timeouts, from
+ * threads that each own a shard with n / shards of the Deferals.  As
+ * no wheel is shared, throughput should rise with the number of
+ * threads, as long as each has a core of its own. */
+static void
+benchShards(unsigned long n, int shards)
+{
+    const unsigned long ops = 1000000;
+    std::vector<std::thread> threads;
+    std::atomic<int> ready(0);
+    std::atomic<bool> go(false);
+    std::atomic<unsigned long> expired(0);
+
+    for (int t = 0; t < shards; t++) {
+	threads.push_back(std::thread([&]() {
+	    DeferalShard shard(shardMillis);
+	    std::vector<Deferal *> mine;
+	    unsigned long count = (n + shards - 1) / shards;
+	    unsigned long drained = 0;
+
+	    shard_count = 0;
+	    for (unsigned long i = 0; i < count; i++) {
+		mine.push_back(new Deferal(100, false, true, shard));
+	    }
+	    ready++;
+	    while (!go) {
+	    }
+	    for (unsigned long i = 0; i < ops; i++) {
+		mine[i % count]->start(50 + (i & 63));
+		if ((i & 127) == 127) {
+		    shard_count++;
+		    drained += shard.drainExpired();
+		}
+	    }
+	    expired += drained;
+	    for (unsigned long i = 0; i < count; i++) {
+		delete mine[i];
+	    }
+	}));
+    }
+    while (ready < shards) {
+    }
+    double start = nowNs();
+    go = true;
+    for (int t = 0; t < shards; t++) {
+	threads[t].join();
+    }
+    double elapsed_ns = nowNs() - start;
+
+    printf("bench=shards n=%lu shards=%d expired=%lu ns_per_op=%.2f "
+	   "mops_per_sec=%.2f\n", n, shards, (unsigned long) expired,
+	   elapsed_ns / (ops * shards), ops * shards * 1000.0 / elapsed_ns);
+}
+
+static std::atomic<unsigned long> exec_calls(0);
+
+/* A callback that spins for callback_cost iterations. */
+static void
+execCallback(void *param)
+{
+    unsigned long sink = 0;
+    for (int i = 0; i < callback_cost; i++) {
+	sink += i;
+	__asm__ __volatile__("" : "+r" (sink));
+    }
+    exec_calls++;
+}
+
+/* Measure draining n autorepeating Deferals, with callbacks of the
+ * given cost, for 100 ticks of simulated time, with the callbacks
+ * run by a pool of workers, or by the poller if workers is 0. */
+static void
+benchExecutor(unsigned long n, unsigned workers, int cost)
+{
+    std::vector<Deferal *> deferals;
+    DeferalExecutor *pool = workers? new DeferalExecutor(workers): NULL;
+    unsigned long i;
+
+    milli_count = 0;
+    callback_cost = cost;
+    exec_calls = 0;
+    Deferal::setExecutor(pool);
+    for (i = 0; i < n; i++) {
+	deferals.push_back(new Deferal(1 + i % 10, execCallback, NULL, true));
+    }
+
+    double start = nowNs();
+    for (milli_count = 1; milli_count <= 100; milli_count++) {
+	Deferal::drainExpired();
+    }
+    double poll_ns = nowNs() - start;
+    if (pool) {
+	pool->wait();
+    }
+    double total_ns = nowNs() - start;
+
+    printf("bench=executor n=%lu workers=%u cb=%d calls=%lu "
+	   "poll_ns_per_call=%.2f calls_per_sec=%.0f mean_latency_ns=%lu "
+	   "max_latency_ns=%lu inlined=%lu\n", n, workers, cost,
+	   (unsigned long) exec_calls, poll_ns / exec_calls,
+	   exec_calls * 1e9 / total_ns, pool? pool->meanLatency(): 0,
+	   pool? pool->maxLatency(): 0, pool? pool->inlined(): 0);
+
+    Deferal::setExecutor(NULL);
+    for (i = 0; i < n; i++) {
+	delete deferals[i];
+    }
+    delete pool;
+}
+#endif
+
+int
+main(int argc, char *argv[])
+{
+    unsigned long max_n = (argc > 1)? strtoul(argv[1], NULL, 10): 1000000;
+    static const int restarts[] = {0, 50};
+    static const int costs[] = {0, 100};
+
+    for (unsigned long n = 10; n <= max_n; n *= 10) {
+	benchClock<Deferal>("timerfn", n);
+	benchClock<MillisDeferal>("millis", n);
+	for (int dist = DIST_SAME; dist <= DIST_SPREAD; dist++) {
+	    benchArm(n, (dist_t) dist);
+	    for (int r = 0; r < 2; r++) {
+		for (int c = 0; c < 2; c++) {
+		    benchPoll(n, (dist_t) dist, restarts[r], costs[c]);
+		}
+	    }
+	}
+	benchRestart(n, false);
+	benchRestart(n, true);
+	if (n <= POOL_SIZE) {
+	    benchPool(n, false);
+	    benchPool(n, true);
+	}
+	if (n <= TABLE_SIZE) {
+	    benchTable(n, false);
+	    benchTable(n, true);
+	}
+	benchCallable(n, false);
+	benchCallable(n, true);
+	for (int policy = DEFERAL_CATCHUP_ALL; policy <= DEFERAL_CATCHUP_BURST;
+	     policy++) {
+	    benchCatchup(n, 1, (deferal_catchup_t) policy);
+	    benchCatchup(n, 100, (deferal_catchup_t) policy);
+	}
+#ifdef DEFERAL_THREADS
+	for (int producers = 1; producers <= 8; producers *= 2) {
+	    benchProducers(n, producers);
+	    benchShards(n, producers);
+	}
+	for (unsigned workers = 0; workers <= 4; workers = workers? workers * 2: 1) {
+	    benchExecutor(n, workers, 1000);
+	}
+#endif
+    }
+    return 0;
+}
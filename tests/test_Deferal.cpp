@@ -1,6 +1,14 @@
 
 #include "cppunit.h"
 #include <Deferal.h>
+#include <limits.h>
+#include <vector>
+#if defined(__linux__) && defined(DEFERAL_TIMERFD)
+#include <poll.h>
+#endif
+#ifdef DEFERAL_THREADS
+#include <thread>
+#endif
 
 static unsigned long milli_count = 1000;
 
@@ -11,6 +19,25 @@ millis(void)
 }
 
 
+static unsigned long micro_count = 0;
+
+unsigned long
+micros(void)
+{
+    return micro_count;
+}
+
+static unsigned long tick_count = 0;
+
+static int tick_reads = 0;
+
+static unsigned long
+ticks(void)
+{
+    tick_reads++;
+    return tick_count;
+}
+
 static int counter = 0;
 
     static void
@@ -19,6 +46,153 @@ static int counter = 0;
 	counter++;
     }
     
+#ifdef DEFERAL_STATS
+static void
+slowCallback(void *ignore)
+{
+    counter++;
+    micro_count += 40;
+}
+#endif
+
+static void
+countCall(void *count)
+{
+    (*(int *) count)++;
+}
+
+/* For test_table: the timer ids in the order they expire, and a
+ * table whose timers stop others. */
+static unsigned table_trace[64];
+static unsigned table_traced = 0;
+static DeferalTable<40> *stopping_table;
+
+static void
+traceTable(void *id)
+{
+    table_trace[table_traced++] = (unsigned) (uintptr_t) id;
+}
+
+static void
+stopFirst(void *id)
+{
+    traceTable(id);
+    stopping_table->stop(0, false);
+}
+
+/* For test_catchup: count calls, and record the missed periods seen
+ * by the latest. */
+static int once_calls = 0;
+static unsigned once_missed = 0;
+
+static void
+noteMissed(void *deferal)
+{
+    once_calls++;
+    once_missed = ((Deferal *) deferal)->missedPeriods();
+}
+
+static unsigned long sleeps[10];
+static int sleep_count = 0;
+static unsigned long sleep_step = 0;
+static int wake_after = 0;
+
+/* A sleep hook that advances the clock by up to sleep_step, as if
+ * woken by an interrupt, and calls wake() on its wake_after'th
+ * call. */
+static void
+fakeSleep(unsigned long duration)
+{
+    sleeps[sleep_count++] = duration;
+    milli_count += (duration < sleep_step)? duration: sleep_step;
+    if (sleep_count == wake_after) {
+	Deferal::wake();
+    }
+}
+
+static Deferal *drained[10];
+static int drained_count = 0;
+
+static void
+recordDrained(Deferal *deferal, void *param)
+{
+    drained[drained_count++] = deferal;
+    *((int *) param) += 1;
+}
+
+static void
+stopDeferal(void *deferal)
+{
+    ((Deferal *) deferal)->stop(false);
+}
+
+#ifdef DEFERAL_THREADS
+static thread_local unsigned long shard_ticks = 0;
+
+static unsigned long
+shardTicks(void)
+{
+    return shard_ticks;
+}
+
+static std::atomic<int> exec_active(0);
+static std::atomic<int> exec_overlaps(0);
+static std::atomic<int> exec_calls(0);
+
+/* A slow post Deferal function that counts the calls that overlap. */
+static void
+overlapCheck(void *ignore)
+{
+    if (exec_active++) {
+	exec_overlaps++;
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds(50));
+    exec_active--;
+    exec_calls++;
+}
+#endif
+
+#ifdef DEFERAL_COROUTINES
+static unsigned long co_trace[2 * DEFERAL_TASK_FRAMES];
+static int co_steps = 0;
+
+/* A coroutine that records the time at each step. */
+static DeferalTask
+sleeper()
+{
+    co_trace[co_steps++] = milli_count;
+    co_await deferalSleepFor(100);
+    co_trace[co_steps++] = milli_count;
+    co_await deferalSleepFor(0);
+    co_await deferalSleepFor(50);
+    co_trace[co_steps++] = milli_count;
+}
+
+#ifdef DEFERAL_THREADS
+/* A coroutine that finishes without waiting. */
+static DeferalTask
+quick()
+{
+    co_return;
+}
+#endif
+
+/* A coroutine that waits for a Deferal to expire twice. */
+static DeferalTask
+waiter(Deferal *deferal)
+{
+    co_await *deferal;
+    co_trace[co_steps++] = milli_count;
+    co_await *deferal;
+    co_trace[co_steps++] = milli_count;
+}
+#endif
+
+/* A functor holding a pointer to a count. */
+struct Counter {
+    int *count;
+    void operator()() { (*count)++; }
+};
 
 class Cppunit_tests: public Cppunit
 {
@@ -33,6 +207,38 @@ class Cppunit_tests: public Cppunit
 	test_pause();
 	test_multiple_delays();
 	test_deferal_fn();
+	test_wheel();
+	test_next_expiry();
+	test_removal();
+	test_drain();
+	test_tick();
+	test_domains();
+	test_counter();
+	test_millis_clock();
+	test_size();
+	test_catchup();
+	test_slack();
+	test_idle();
+	test_isr();
+	test_callables();
+	test_pool();
+	test_move();
+	test_table();
+	test_lazy_restart();
+#ifdef DEFERAL_COROUTINES
+	test_coroutines();
+#endif
+#ifdef DEFERAL_THREADS
+	test_threads();
+	test_shards();
+	test_executor();
+#endif
+#if defined(__linux__) && defined(DEFERAL_TIMERFD)
+	test_timerfd();
+#endif
+#ifdef DEFERAL_STATS
+	test_stats();
+#endif
     }
 
     /* Test a single Deferal with simple delays. */
@@ -132,6 +338,21 @@ class Cppunit_tests: public Cppunit
 	CHECKT(pausedelay.stopped());
 	pausedelay.pause();
 	CHECKT(pausedelay.stopped());
+
+	// TEST: Stopping a paused Deferal leaves it as if it had been
+	// stopped at the time of the pause, so again() works from its
+	// start.
+	int calls = 0;
+	milli_count = 1000000;
+	Deferal stopdelay(100, countCall, &calls);
+	milli_count = 1000050;
+	stopdelay.pause();
+	stopdelay.stop(false);
+	milli_count = 1000120;
+	stopdelay.again();
+	CHECKT(stopdelay.running());
+	CHECK(stopdelay.remaining(), 80);
+	CHECK(calls, 0);
     }
     
     // Multiple delays, and constructor/destructor tests.
@@ -253,6 +474,1236 @@ class Cppunit_tests: public Cppunit
         CHECKT(counter == 2);
     }
 
+    /* Check that Deferals are reported in expiry order, across
+     * wheel levels and the wrap-around of the timer function, and
+     * that Deferals using other timer functions are still reported. */
+    void
+    test_wheel()
+    {
+	milli_count = ULONG_MAX - 100;
+	tick_count = 0;
+	Deferal far(70000);
+	Deferal near(50);
+	Deferal wrapped(150);
+	Deferal same(150);
+	Deferal other(10, false, true, ticks);
+	Deferal paused(20);
+
+	CHECKP(Deferal::checkDeferals(), NULL);
+	paused.pause();
+	milli_count += 49;
+	CHECKP(Deferal::checkDeferals(), NULL);
+	milli_count += 200;
+	CHECKP(Deferal::checkDeferals(), &near);
+	CHECKP(Deferal::checkDeferals(), &wrapped);
+	CHECKP(Deferal::checkDeferals(), &same);
+	CHECKP(Deferal::checkDeferals(), NULL);
+	tick_count = 10;
+	CHECKP(Deferal::checkDeferals(), &other);
+	CHECKP(Deferal::checkDeferals(), NULL);
+
+	// Restarting a running Deferal moves its expiry time.
+	far.start(100);
+	milli_count += 99;
+	CHECKP(Deferal::checkDeferals(), NULL);
+	paused.resume();
+	milli_count += 1;
+	CHECKP(Deferal::checkDeferals(), &far);
+	CHECKP(Deferal::checkDeferals(), NULL);
+	milli_count += 19;
+	CHECKP(Deferal::checkDeferals(), &paused);
+	CHECKP(Deferal::checkDeferals(), NULL);
+    }
+
+    void
+    test_next_expiry()
+    {
+	milli_count = 1000;
+	tick_count = 0;
+	CHECKP(Deferal::nextExpiry(), NULL);
+	CHECK(Deferal::timeUntilNextExpiry(), ULONG_MAX);
+
+	Deferal late(5000);
+	Deferal soon(300);
+	Deferal sooner(300);
+	Deferal other(10, false, true, ticks);
+	CHECKP(Deferal::nextExpiry(), &soon);
+	CHECK(Deferal::timeUntilNextExpiry(), 300);
+	CHECKP(Deferal::nextExpiry(ticks), &other);
+	CHECK(Deferal::timeUntilNextExpiry(ticks), 10);
+
+	// Re-keying with setOffset(), setDelay() and pause().
+	sooner.setOffset(400);
+	CHECKP(Deferal::nextExpiry(), &sooner);
+	CHECK(Deferal::timeUntilNextExpiry(), 200);
+	sooner.pause();
+	soon.setDelay(6000);
+	CHECKP(Deferal::nextExpiry(), &late);
+	milli_count = 7000;
+	CHECK(Deferal::timeUntilNextExpiry(), 0);
+	CHECKP(Deferal::checkDeferals(), &late);
+	CHECKP(Deferal::nextExpiry(), &soon);
+	soon.stop();
+	CHECKP(Deferal::nextExpiry(), NULL);
+	other.stop();
+    }
+
+    /* Check that Deferals may be paused, stopped or destroyed at any
+     * point, including after they have expired but before they have
+     * been reported by checkDeferals(). */
+    void
+    test_removal()
+    {
+	milli_count = 1000;
+	Deferal first(100);
+	Deferal *doomed = new Deferal(100);
+	Deferal last(100);
+	Deferal paused(100);
+	paused.pause();
+	
+	milli_count = 1100;
+	CHECKP(Deferal::checkDeferals(), &first);
+	delete doomed;
+	CHECKP(Deferal::nextExpiry(), &last);
+	CHECKP(Deferal::checkDeferals(), &last);
+	CHECKP(Deferal::checkDeferals(), NULL);
+	CHECKT(paused.paused());
+	CHECKP(Deferal::nextExpiry(), NULL);
+
+	first.again();
+	last.again();
+	first.stop(false);
+	milli_count = 1200;
+	CHECKP(Deferal::checkDeferals(), &last);
+	CHECKP(Deferal::checkDeferals(), NULL);
+    }
+
+    /* Check that drainExpired() expires everything that is due, in
+     * expiry order, and copes with post Deferal functions that stop
+     * other Deferals. */
+    void
+    test_drain()
+    {
+	int visits = 0;
+	milli_count = 1000;
+	tick_count = 0;
+	counter = 0;
+	drained_count = 0;
+	Deferal second(200);
+	Deferal first(100);
+	Deferal victim(200);
+	Deferal killer(150, stopDeferal, &victim);
+	Deferal repeater(50, endDelay, NULL, true);
+	Deferal other(5, false, true, ticks);
+	Deferal later(500);
+
+	CHECK(Deferal::drainExpired(), 0);
+	milli_count = 1200;
+	tick_count = 5;
+	CHECK(Deferal::drainExpired(recordDrained, &visits), 6);
+	CHECK(visits, 6);
+	CHECKP(drained[0], &repeater);
+	CHECKP(drained[1], &first);
+	CHECKP(drained[2], &killer);
+	CHECKP(drained[3], &second);
+	CHECKP(drained[4], &other);
+	// repeater catches up to expire again at 1200
+	CHECKP(drained[5], &repeater);
+	CHECKT(victim.stopped());
+	CHECK(counter, 4);
+	CHECKT(repeater.running());
+	CHECKT(later.running());
+	CHECKP(Deferal::checkDeferals(), NULL);
+	repeater.stop(false);
+    }
+
+    /* Check that time stands still within a tick, and that each timer
+     * function is read only once per tick. */
+    void
+    test_tick()
+    {
+	milli_count = 1000;
+	tick_count = 0;
+	Deferal delay1(100);
+	Deferal counted1(10, false, true, ticks);
+	Deferal counted2(20, false, true, ticks);
+
+	Deferal::beginTick();
+	tick_reads = 0;
+	CHECKT(delay1.running());
+	CHECKT(counted1.running());
+	milli_count = 1100;
+	tick_count = 20;
+	CHECK(delay1.remaining(), 100);
+	CHECKT(counted1.running());
+	CHECKT(counted2.running());
+	CHECK(counted2.remaining(), 20);
+	CHECK(tick_reads, 1);
+	CHECKP(Deferal::checkDeferals(), NULL);
+
+	// A new tick sees the new time.
+	Deferal::beginTick();
+	CHECK(delay1.remaining(), 0);
+	CHECK(counted1.remaining(), -10);
+	CHECK(counted2.remaining(), 0);
+	CHECK(Deferal::drainExpired(), 3);
+	CHECK(tick_reads, 2);
+	Deferal::endTick();
+	
+	milli_count = 1150;
+	delay1.start();
+	CHECK(delay1.remaining(), 100);
+	milli_count = 1160;
+	CHECK(delay1.remaining(), 90);
+    }
+
+    /* Check that each timer function's Deferals are kept separately,
+     * and that a timer function is not read by polls unless it has
+     * running Deferals. */
+    void
+    test_domains()
+    {
+	milli_count = 1000;
+	tick_count = 0;
+	Deferal delay1(100);
+	Deferal counted(1000, false, false, ticks);
+
+	tick_reads = 0;
+	CHECKP(Deferal::checkDeferals(), NULL);
+	CHECK(Deferal::drainExpired(), 0);
+	CHECKP(Deferal::nextExpiry(ticks), NULL);
+	CHECK(tick_reads, 0);
+
+	counted.start();
+	tick_reads = 0;
+	CHECKP(Deferal::checkDeferals(), NULL);
+	CHECK(tick_reads, 1);
+	CHECKP(Deferal::nextExpiry(ticks), &counted);
+	CHECKP(Deferal::nextExpiry(), &delay1);
+	
+	milli_count = 1100;
+	tick_count = 1000;
+	CHECKP(Deferal::checkDeferals(), &delay1);
+	CHECKP(Deferal::checkDeferals(), &counted);
+	tick_reads = 0;
+	CHECKP(Deferal::checkDeferals(), NULL);
+	CHECK(tick_reads, 0);
+    }
+
+    /* Check that Deferals bound to a DeferalCounter expire only when
+     * the counter is advanced past their delays. */
+    void
+    test_counter()
+    {
+	DeferalCounter bytes;
+	counter = 0;
+	drained_count = 0;
+	int visits = 0;
+	Deferal chunk(64, endDelay, NULL, true, true, bytes);
+	Deferal line(80, false, true, bytes);
+	Deferal idle(100, false, false, bytes);
+
+	CHECKP(Deferal::checkDeferals(), NULL);
+	CHECK(bytes.advance(63), 0);
+	CHECK(chunk.remaining(), 1);
+	CHECK(bytes.advance(), 1);
+	CHECK(counter, 1);
+	CHECKT(chunk.running());
+	CHECK(bytes.advance(16, recordDrained, &visits), 1);
+	CHECKP(drained[0], &line);
+	CHECKT(line.stopped());
+	idle.start();
+	// chunk catches up within again(), so is only visited once
+	CHECK(bytes.advance(200), 2);
+	CHECK(counter, 4);
+	CHECK(bytes.value(), 280);
+	CHECKT(idle.stopped());
+	chunk.stop(false);
+    }
+
+    /* Check that Deferals with a static clock behave as Deferals do,
+     * are smaller, and are polled separately. */
+    void
+    test_millis_clock()
+    {
+	milli_count = 1000;
+	counter = 0;
+	MillisDeferal fast(100, endDelay, NULL, true);
+	MillisDeferal once(150);
+	Deferal slow(100);
+
+	CHECKT(sizeof(MillisDeferal) < sizeof(Deferal));
+	CHECKP(MillisDeferal::nextExpiry(), &fast);
+	CHECK(MillisDeferal::timeUntilNextExpiry(), 100);
+	milli_count = 1100;
+	CHECKP(MillisDeferal::checkDeferals(), &fast);
+	CHECKP(MillisDeferal::checkDeferals(), NULL);
+	CHECK(counter, 1);
+	CHECKP(Deferal::checkDeferals(), &slow);
+	CHECKP(Deferal::checkDeferals(), NULL);
+	milli_count = 1200;
+	CHECK(MillisDeferal::drainExpired(), 2);
+	CHECK(counter, 2);
+	CHECKT(once.stopped());
+	CHECKT(fast.running());
+	fast.stop(false);
+    }
+
+    /* Check that a Deferal is no bigger than its pointers, two
+     * ticks, two bytes of flags, a missed period count and its slack,
+     * rounded up to its alignment. */
+    void
+    test_size()
+    {
+#ifdef DEFERAL_STATS
+	size_t packed = 6 * sizeof(void *) + 2 * sizeof(deferal_tick_t) + 6;
+#else
+	size_t packed = 5 * sizeof(void *) + 2 * sizeof(deferal_tick_t) + 6;
+#endif
+#ifdef DEFERAL_THREADS
+	packed += sizeof(void *) + sizeof(uint64_t) + 2 * sizeof(bool) +
+	    sizeof(uint16_t);
+#endif
+	packed += DEFERAL_FN_SIZE;
+	size_t align = alignof(DeferalBase);
+
+	CHECK(sizeof(DeferalBase), (packed + align - 1) / align * align);
+	CHECK(sizeof(MillisDeferal), sizeof(DeferalBase));
+	CHECK(sizeof(Deferal), sizeof(DeferalBase) + sizeof(void *));
+
+	// Pausing keeps the elapsed time in place of the start time.
+	milli_count = 1000;
+	Deferal delay(100);
+	milli_count = 1030;
+	delay.pause();
+	milli_count = 5000;
+	CHECK(delay.remaining(), 70);
+	delay.resume();
+	CHECK(delay.remaining(), 70);
+	milli_count = 5070;
+	CHECKT(delay.stopped());
+    }
+
+    /* Check that each catch-up policy resumes at the next period,
+     * calling the post Deferal function the expected number of
+     * times. */
+    void
+    test_catchup()
+    {
+	int all = 0, skip = 0, burst = 0;
+	milli_count = 1000;
+	Deferal all_d(100, countCall, &all, true);
+	Deferal once_d(100, true);
+	Deferal skip_d(100, countCall, &skip, true);
+	Deferal burst_d(100, countCall, &burst, true);
+	once_d.setCatchup(DEFERAL_CATCHUP_ONCE);
+	once_d.setDeferalFn(noteMissed, &once_d);
+	once_calls = 0;
+	skip_d.setCatchup(DEFERAL_CATCHUP_SKIP);
+	burst_d.setCatchup(DEFERAL_CATCHUP_BURST, 2);
+	CHECK(burst_d.catchup(), DEFERAL_CATCHUP_BURST);
+
+	// Expired at 1100, and missed 1200, 1300, 1400 and 1500.
+	milli_count = 1550;
+	CHECK(Deferal::drainExpired(), 4);
+	CHECK(all, 5);
+	CHECK(once_calls, 1);
+	CHECK(once_missed, 4);
+	CHECK(skip, 1);
+	CHECK(burst, 3);
+	CHECK(once_d.missedPeriods(), 4);
+	CHECK(all_d.remaining(), 50);
+	CHECK(once_d.remaining(), 50);
+	CHECK(skip_d.remaining(), 50);
+	CHECK(burst_d.remaining(), 50);
+
+	// Catching up on a very long period takes no longer.
+	unsigned long periods = DEFERAL_TICK_MAX / 200;
+	if (periods > 1000000) {
+	    periods = 1000000;
+	}
+	milli_count += periods * 100;
+	CHECK(Deferal::drainExpired(), 4);
+	CHECK(skip, 2);
+	CHECK(skip_d.missedPeriods(), (periods > 65536)? 65535: periods - 1);
+	CHECK(skip_d.remaining(), 50);
+	all_d.stop(false);
+	once_d.stop(false);
+	skip_d.stop(false);
+	burst_d.stop(false);
+
+	// A burst defaults to the largest, and is at least 1.
+	burst = 0;
+	burst_d.setCatchup(DEFERAL_CATCHUP_BURST);
+	burst_d.start();
+	milli_count += 100 * (DEFERAL_MAX_BURST + 10);
+	CHECK(Deferal::drainExpired(), 1);
+	CHECK(burst, 1 + DEFERAL_MAX_BURST);
+	burst_d.setCatchup(DEFERAL_CATCHUP_BURST, 0);
+	milli_count += 1000;
+	CHECK(Deferal::drainExpired(), 1);
+	CHECK(burst, 1 + DEFERAL_MAX_BURST + 2);
+	burst_d.stop(false);
+    }
+
+    /* Check that Deferals with slack are reported at the coarsest
+     * time within their windows, and so are coalesced. */
+    void
+    test_slack()
+    {
+	milli_count = 1000;
+	Deferal a(100);
+	Deferal b(110);
+	Deferal c(115);
+	Deferal d(100);
+	a.setSlack(30);
+	b.setSlack(20);
+	CHECK(a.slack(), 30);
+
+	// a's window is 1100..1130, and b's 1110..1130.  Both are
+	// reported at 1120.
+	milli_count = 1100;
+	CHECKP(Deferal::checkDeferals(), &d);
+	CHECKP(Deferal::checkDeferals(), NULL);
+	CHECKP(Deferal::nextExpiry(), &c);
+	milli_count = 1116;
+	CHECKP(Deferal::checkDeferals(), &c);
+	CHECKP(Deferal::nextExpiry(), &a);
+	CHECK(Deferal::timeUntilNextExpiry(), 4);
+	milli_count = 1119;
+	CHECKP(Deferal::checkDeferals(), NULL);
+	milli_count = 1120;
+	CHECKP(Deferal::checkDeferals(), &a);
+	CHECKP(Deferal::checkDeferals(), &b);
+	CHECKP(Deferal::checkDeferals(), NULL);
+
+	// Status checks still see the expiry time.
+	a.start();
+	milli_count = 1220;
+	CHECKT(a.stopped());
+	d.setSlack(70000);
+	CHECK(d.slack(), DEFERAL_MAX_SLACK);
+
+	// Even the most slack does not make a Deferal early, as it
+	// would if its window passed half the tick range.
+	Deferal e(100);
+	e.setSlack(40000);
+	CHECKP(Deferal::checkDeferals(), NULL);
+	milli_count = 1320;
+	CHECKP(Deferal::checkDeferals(), NULL);
+	milli_count = 1320 + DEFERAL_MAX_SLACK;
+	CHECKP(Deferal::checkDeferals(), &e);
+    }
+
+    /* Check that idleUntilNext() sleeps until the next expiry, and
+     * that wake() interrupts it. */
+    void
+    test_idle()
+    {
+	milli_count = 1000;
+	sleep_count = 0;
+	wake_after = 0;
+	sleep_step = ULONG_MAX;
+	Deferal delay(100);
+
+	// Without a sleep hook, we cannot idle.
+	CHECKT(!Deferal::idleUntilNext());
+	Deferal::setSleepFn(fakeSleep);
+	CHECKT(!Deferal::idleUntilNext());
+	CHECK(sleep_count, 1);
+	CHECK(sleeps[0], 100);
+	CHECK(milli_count, 1100);
+	CHECKP(Deferal::checkDeferals(), &delay);
+
+	// Interrupts wake us early, so we sleep again.
+	sleep_count = 0;
+	sleep_step = 30;
+	delay.start();
+	CHECKT(!Deferal::idleUntilNext());
+	CHECK(sleep_count, 4);
+	CHECK(sleeps[3], 10);
+	CHECKP(Deferal::checkDeferals(), &delay);
+
+	// With nothing to wait for, we sleep until woken.
+	sleep_count = 0;
+	wake_after = 2;
+	CHECKT(Deferal::idleUntilNext());
+	CHECK(sleep_count, 2);
+	CHECK(sleeps[0], ULONG_MAX);
+
+	// A wake() before idling prevents the sleep.
+	sleep_count = 0;
+	delay.start();
+	Deferal::wake();
+	CHECKT(Deferal::idleUntilNext());
+	CHECK(sleep_count, 0);
+	Deferal::setSleepFn(NULL);
+	delay.stop(false);
+    }
+
+    /* Check that commands from interrupt handlers are only applied
+     * by the next poll, in order, and that a full ring drops them. */
+    void
+    test_isr()
+    {
+	milli_count = 1000;
+	counter = 0;
+	Deferal delay(100, endDelay, NULL, false, false);
+	Deferal other(100);
+
+	CHECKT(delay.startFromISR());
+	CHECKT(delay.stopped());
+	CHECKP(Deferal::checkDeferals(), NULL);
+	CHECKT(delay.running());
+
+	CHECKT(delay.stopFromISR(false));
+	CHECKT(delay.againFromISR(50));
+	CHECKT(delay.running());
+	CHECK(Deferal::drainExpired(), 0);
+	CHECK(counter, 0);
+	// again() runs from the end of the stopped period.
+	CHECK(delay.remaining(), 150);
+
+	// A full ring drops further commands.
+	for (int i = 0; i < DEFERAL_ISR_RING_SIZE; i++) {
+	    CHECKT(other.stopFromISR());
+	}
+	CHECKT(!delay.stopFromISR());
+	CHECKT(Deferal::idleUntilNext());
+	milli_count = 1150;
+	CHECKP(Deferal::checkDeferals(), &delay);
+	CHECKT(other.stopped());
+	CHECK(counter, 1);
+    }
+
+    /* Check that lambdas and functors may be called on expiry, with
+     * their captures stored in the Deferal. */
+    void
+    test_callables()
+    {
+	int count = 0;
+	milli_count = 1000;
+	Deferal lambda(10, [&count]() { count++; });
+	Deferal functor(20, Counter{&count}, true);
+	Deferal plain(30, countCall, &count);
+
+	milli_count = 1030;
+	CHECK(Deferal::drainExpired(), 3);
+	CHECK(count, 3);
+	CHECKT(lambda.stopped());
+	CHECKT(functor.running());
+
+	// A captureless lambda, and one replacing a PostDeferalFn.
+	plain.setDeferalFn([]() { counter++; });
+	plain.start();
+	counter = 0;
+	milli_count = 1060;
+	Deferal::drainExpired();
+	CHECK(counter, 1);
+	// The functor autorepeats, at 1040 and 1060.
+	CHECK(count, 5);
+	functor.stop(false);
+
+#if DEFERAL_FN_SIZE >= 16
+	// Larger captures are stored in the Deferal itself.
+	long step = 10;
+	lambda.setDeferalFn([&count, step]() { count += step; });
+	lambda.start();
+	milli_count = 1070;
+	Deferal::drainExpired();
+	CHECK(count, 15);
+#endif
+    }
+
+    /* Check that a pool allocates Deferals contiguously, detects
+     * stale handles, and records its high-water mark. */
+    void
+    test_pool()
+    {
+	DeferalPool<3> pool;
+	milli_count = 1000;
+	counter = 0;
+
+	deferal_handle_t first = pool.create(100, endDelay, (void *) NULL);
+	deferal_handle_t second = pool.create(200, false, false);
+	CHECKT(first != DEFERAL_NULL_HANDLE);
+	CHECKP(pool.get(second), pool.get(first) + 1);
+	CHECKT(pool.get(first)->running());
+	CHECKT(pool.get(second)->stopped());
+	CHECK(pool.inUse(), 2);
+
+	// A released Deferal leaves its wheel, and its handle is stale.
+	CHECKT(pool.release(first));
+	CHECKP(pool.get(first), NULL);
+	CHECKT(!pool.release(first));
+	CHECKP(Deferal::nextExpiry(), NULL);
+
+	// Its slot is reused, with a new handle.
+	deferal_handle_t third = pool.create(50, [](){ counter++; });
+	deferal_handle_t fourth = pool.create(60);
+	CHECKT(third != first);
+	CHECKP(pool.get(first), NULL);
+	CHECKT(pool.get(third) != NULL);
+	CHECK(pool.create(70), DEFERAL_NULL_HANDLE);
+	CHECK(pool.inUse(), 3);
+	CHECK(pool.highWater(), 3);
+
+	milli_count = 1050;
+	CHECKP(Deferal::checkDeferals(), pool.get(third));
+	CHECK(counter, 1);
+	CHECKT(pool.release(third));
+	CHECKT(pool.release(fourth));
+	CHECK(pool.inUse(), 1);
+	CHECK(pool.highWater(), 3);
+	CHECKP(pool.get(DEFERAL_NULL_HANDLE), NULL);
+
+	// Once a slot's generation wraps round, the null handle is
+	// still invalid.
+	DeferalPool<1> single;
+	unsigned cycles = 0;
+	while (cycles < 0x8000
+	       && single.release(single.create(100, false, false))) {
+	    cycles++;
+	}
+	CHECK(cycles, 0x8000);
+	CHECKP(single.get(DEFERAL_NULL_HANDLE), NULL);
+	CHECKT(!single.release(DEFERAL_NULL_HANDLE));
+	deferal_handle_t fifth = single.create(100, false, false);
+	CHECKT(fifth != DEFERAL_NULL_HANDLE);
+	CHECKT(single.get(fifth) != NULL);
+	CHECK(single.create(100), DEFERAL_NULL_HANDLE);
+    }
+
+    /* Check that moved Deferals take the place of the originals in
+     * the wheel, so that they may be kept in a growing vector. */
+    void
+    test_move()
+    {
+	std::vector<Deferal> deferals;
+	int calls = 0;
+	milli_count = 1000;
+
+	// Each push may move every Deferal already in the vector.
+	for (int i = 0; i < 20; i++) {
+	    deferals.push_back(Deferal(100 - i, countCall, &calls));
+	}
+	// Several share a slot, as do these, with the first moved.
+	deferals.push_back(Deferal(50, countCall, &calls));
+	deferals.push_back(Deferal(50, countCall, &calls));
+	deferals[1] = std::move(deferals[20]);
+	CHECKT(deferals[20].stopped());
+	CHECKT(deferals[1].running());
+
+	milli_count = 1050;
+	CHECK(Deferal::drainExpired(), 2);
+	CHECKT(deferals[1].stopped());
+	CHECKT(deferals[21].stopped());
+	milli_count = 1100;
+	CHECK(Deferal::drainExpired(), 19);
+	CHECK(calls, 21);
+
+	// A stored functor moves with its Deferal.
+	int count = 0;
+	Deferal original(10, [&count]() { count++; }, true);
+	Deferal moved(std::move(original));
+	CHECKT(original.stopped());
+	CHECKT(moved.running());
+	milli_count = 1110;
+	CHECKP(Deferal::checkDeferals(), &moved);
+	CHECK(count, 1);
+	moved.stop(false);
+
+#if DEFERAL_FN_SIZE >= 16
+	// As does one kept in its own storage.
+	long step = 2;
+	Deferal stored(10, [&count, step]() { count += step; });
+	Deferal target(std::move(stored));
+	milli_count = 1120;
+	CHECKP(Deferal::checkDeferals(), &target);
+	CHECK(count, 3);
+#endif
+    }
+
+    /* Check that the vector scan of deadlines agrees with a simple
+     * comparison, across wrap-around, and that a DeferalTable expires
+     * its timers. */
+    void
+    test_table()
+    {
+	deferal_tick_t deadlines[45];
+	deferal_tick_t now = DEFERAL_TICK_MAX - 4;
+	unsigned i;
+
+	// Every position in turn, with none before it reached.
+	for (unsigned due = 0; due <= 45; due++) {
+	    for (i = 0; i < 45; i++) {
+		deadlines[i] = now + 1 + i;
+	    }
+	    if (due < 45) {
+		deadlines[due] = now - due;
+	    }
+	    CHECK(deferalFindExpired(deadlines, 0, 45, now), due);
+	    CHECK(deferalFindExpired(deadlines, due, due, now), due);
+	}
+	// A deadline half the range of a tick ahead is not reached.
+	deadlines[0] = now + (DEFERAL_TICK_MAX >> 1);
+	deadlines[1] = now - (DEFERAL_TICK_MAX >> 1);
+	CHECK(deferalFindExpired(deadlines, 0, 2, now), 1);
+
+	DeferalTable<40> table;
+	milli_count = 1000;
+	table_traced = 0;
+	for (i = 0; i < 40; i++) {
+	    table.setDeferalFn(i, traceTable, (void *) (uintptr_t) i);
+	    table.start(i, 100 + i);
+	}
+	CHECK(table.count(), 40);
+	CHECK(table.remaining(5), 105);
+
+	// Restarting keeps a timer's place.
+	table.start(3, 10);
+	table.start(38, 10, true);
+	table.stop(7);
+	CHECKT(!table.running(7));
+	CHECK(table_traced, 1);
+	CHECK(table.count(), 39);
+
+	milli_count = 1010;
+	CHECK(table.drainExpired(), 2);
+	CHECK(table_trace[1], 3);
+	CHECK(table_trace[2], 38);
+	CHECKT(table.running(38));
+	CHECK(table.remaining(38), 10);
+	table.stop(38, false);
+	CHECK(table_traced, 3);
+
+	milli_count = 1105;
+	CHECK(table.drainExpired(), 5);
+	CHECK(table.count(), 32);
+	CHECKT(!table.running(5));
+	CHECKT(table.running(6));
+	CHECK(table.drainExpired(), 0);
+	for (i = 0; i < 40; i++) {
+	    table.stop(i, false);
+	}
+	CHECK(table.count(), 0);
+
+	// A timer stopped by one that expires after it in the scan is
+	// replaced by one that has still to be scanned.
+	stopping_table = &table;
+	table.setDeferalFn(39, stopFirst, (void *) 39);
+	table.start(0, 10, true);
+	for (i = 8; i < 19; i++) {
+	    table.start(i, 1000);
+	}
+	table.start(39, 20);
+	table.start(20, 20);
+	milli_count = 1125;
+	table_traced = 0;
+	CHECK(table.drainExpired(), 3);
+	CHECK(table_trace[2], 20);
+	CHECKT(!table.running(0));
+	CHECK(table.count(), 11);
+
+	milli_count = 2105;
+	CHECK(table.drainExpired(), 11);
+	CHECK(table.count(), 0);
+    }
+
+    /* Check that lazily restarted Deferals, left in their slots of
+     * the wheel, still expire exactly on time. */
+    void
+    test_lazy_restart()
+    {
+	int calls = 0;
+	milli_count = 1000;
+
+	// Restarted every 10 ticks, both within level 0 of the wheel
+	// and with a delay placing it in a higher level.
+	Deferal idle(100, countCall, &calls);
+	Deferal retransmit(5000, countCall, &calls);
+	idle.setLazyRestart();
+	retransmit.setLazyRestart();
+	for (milli_count = 1001; milli_count <= 7000; milli_count++) {
+	    if (milli_count % 10 == 0) {
+		idle.start();
+		retransmit.start();
+	    }
+	    CHECKP(Deferal::checkDeferals(), (Deferal *) NULL);
+	}
+	CHECK(calls, 0);
+	CHECK(Deferal::timeUntilNextExpiry(), 99);
+	milli_count = 7099;
+	CHECK(Deferal::drainExpired(), 0);
+	milli_count = 7100;
+	CHECKP(Deferal::checkDeferals(), &idle);
+	milli_count = 11999;
+	CHECKP(Deferal::checkDeferals(), (Deferal *) NULL);
+	milli_count = 12000;
+	CHECKP(Deferal::checkDeferals(), &retransmit);
+	CHECK(calls, 2);
+
+	// Left in a slot at level 0, a restarted Deferal does not
+	// expire early.
+	milli_count = 12416;
+	CHECK(Deferal::drainExpired(), 0);
+	idle.start(5);
+	milli_count = 12418;
+	idle.start(14);
+	for (milli_count = 12419; milli_count < 12432; milli_count++) {
+	    CHECKP(Deferal::checkDeferals(), (Deferal *) NULL);
+	}
+	CHECKP(Deferal::checkDeferals(), &idle);
+
+	// Nor is it taken to be the next to expire.
+	Deferal other(100, countCall, &calls, false, false);
+	milli_count = 12448;
+	CHECK(Deferal::drainExpired(), 0);
+	idle.start(5);
+	milli_count = 12450;
+	idle.start(14);
+	other.start(8);
+	CHECKP(Deferal::nextExpiry(), &other);
+	CHECK(Deferal::timeUntilNextExpiry(), 8);
+	milli_count = 12458;
+	CHECKP(Deferal::checkDeferals(), &other);
+	CHECKP(Deferal::nextExpiry(), &idle);
+	milli_count = 12464;
+	CHECKP(Deferal::checkDeferals(), &idle);
+
+	// Restarting to expire sooner, or once due, places it again.
+	idle.start(100);
+	idle.start(10);
+	milli_count = 12474;
+	CHECKP(Deferal::checkDeferals(), &idle);
+	idle.start(100);
+	milli_count = 12574;
+	idle.start();
+	CHECKT(idle.running());
+	CHECK(Deferal::drainExpired(), 0);
+	milli_count = 12674;
+	CHECK(Deferal::drainExpired(), 1);
+	CHECK(calls, 7);
+
+	// Turning lazy restarts off places it again.
+	milli_count = 12736;
+	CHECK(Deferal::drainExpired(), 0);
+	idle.start(5);
+	milli_count = 12738;
+	idle.start(14);
+	idle.setLazyRestart(false);
+	milli_count = 12741;
+	CHECKP(Deferal::checkDeferals(), (Deferal *) NULL);
+	CHECK(idle.remaining(), 11);
+	milli_count = 12752;
+	CHECKP(Deferal::checkDeferals(), &idle);
+    }
+
+#ifdef DEFERAL_COROUTINES
+    /* Check that coroutines are resumed by polls once their sleeps or
+     * Deferals expire, and that their frames come from the pool. */
+    void
+    test_coroutines()
+    {
+	int calls = 0;
+	milli_count = 1000;
+	co_steps = 0;
+
+	CHECKT(sleeper().valid());
+	CHECK(co_steps, 1);
+	CHECK(DeferalTask::framesInUse(), 1);
+	milli_count = 1099;
+	CHECKP(Deferal::checkDeferals(), NULL);
+	milli_count = 1100;
+	CHECK(Deferal::drainExpired(), 1);
+	CHECK(co_steps, 2);
+	CHECK(co_trace[1], 1100);
+	milli_count = 1150;
+	CHECKT(Deferal::checkDeferals() != NULL);
+	CHECK(co_steps, 2);
+	CHECKP(Deferal::checkDeferals(), NULL);
+	CHECK(co_steps, 3);
+	CHECK(co_trace[2], 1150);
+	CHECK(DeferalTask::framesInUse(), 0);
+
+	// Waiting on a Deferal keeps its own post Deferal function.
+	co_steps = 0;
+	Deferal repeater(30, countCall, &calls, true);
+	waiter(&repeater);
+	milli_count = 1180;
+	Deferal::drainExpired();
+	CHECK(calls, 1);
+	CHECK(co_steps, 1);
+	milli_count = 1210;
+	Deferal::drainExpired();
+	CHECK(calls, 2);
+	CHECK(co_steps, 2);
+	CHECK(co_trace[1], 1210);
+	CHECK(DeferalTask::framesInUse(), 0);
+	repeater.stop(false);
+
+	// An exhausted pool prevents coroutines from starting.
+	co_steps = 0;
+	repeater.start();
+	for (int i = 0; i < DEFERAL_TASK_FRAMES; i++) {
+	    CHECKT(waiter(&repeater).valid());
+	}
+	CHECKT(!waiter(&repeater).valid());
+	CHECK(DeferalTask::framesInUse(), DEFERAL_TASK_FRAMES);
+	milli_count = 1240;
+	Deferal::drainExpired();
+	milli_count = 1270;
+	Deferal::drainExpired();
+	CHECK(co_steps, 2 * DEFERAL_TASK_FRAMES);
+	CHECK(calls, 4);
+	CHECK(DeferalTask::framesInUse(), 0);
+	repeater.stop(false);
+    }
+#endif
+
+#ifdef DEFERAL_THREADS
+    /* Check that commands from other threads are applied by the next
+     * poll, that a later command replaces a pending one, and that no
+     * command is lost while producers race with the dispatcher. */
+    void
+    test_threads()
+    {
+	const int producers = 4;
+	const int per_producer = 50;
+	milli_count = 1000;
+	counter = 0;
+	Deferal delay(100, endDelay, NULL, false, false);
+
+	delay.startAsync();
+	CHECKT(delay.stopped());
+	CHECKP(Deferal::checkDeferals(), NULL);
+	CHECKT(delay.running());
+
+	delay.stopAsync(false);
+	delay.againAsync(50);
+	CHECK(Deferal::drainExpired(), 0);
+	CHECKT(delay.running());
+	CHECK(delay.remaining(), 50);
+	delay.stopAsync();
+	Deferal::applyAsyncCommands();
+	CHECKT(delay.stopped());
+	CHECK(counter, 1);
+
+	std::vector<Deferal *> deferals;
+	for (int i = 0; i < producers * per_producer; i++) {
+	    deferals.push_back(new Deferal(1000, false, false));
+	}
+	std::atomic<int> done(0);
+	std::vector<std::thread> threads;
+	for (int t = 0; t < producers; t++) {
+	    threads.push_back(std::thread([&, t]() {
+		for (int pass = 0; pass < 200; pass++) {
+		    for (int i = 0; i < per_producer; i++) {
+			Deferal *deferal = deferals[t * per_producer + i];
+			deferal->startAsync(pass + 1);
+			deferal->stopAsync(false);
+		    }
+		}
+		// Finish with the odd Deferals running.
+		for (int i = 0; i < per_producer; i++) {
+		    if (i & 1) {
+			deferals[t * per_producer + i]->startAsync(500 + i);
+		    }
+		}
+		done++;
+	    }));
+	}
+	while (done < producers) {
+	    Deferal::checkDeferals();
+	}
+	for (int t = 0; t < producers; t++) {
+	    threads[t].join();
+	}
+	Deferal::applyAsyncCommands();
+	for (int i = 0; i < producers * per_producer; i++) {
+	    int n = i % per_producer;
+	    CHECK(deferals[i]->running(), (bool) (n & 1));
+	    if (n & 1) {
+		CHECK(deferals[i]->remaining(), 500 + n);
+	    }
+	    delete deferals[i];
+	}
+
+	// Threads may use new timer functions while the dispatcher
+	// polls, and share a wheel for each.
+	static const TimerFn timer_fns[2] = {
+	    []() -> unsigned long { return 0; },
+	    []() -> unsigned long { return 1; }
+	};
+	DeferalWheel *found[producers][2];
+	done = 0;
+	threads.clear();
+	for (int t = 0; t < producers; t++) {
+	    threads.push_back(std::thread([&, t]() {
+		found[t][t & 1] = TimerFnClock::wheelFor(timer_fns[t & 1]);
+		found[t][!(t & 1)] = TimerFnClock::wheelFor(timer_fns[!(t & 1)]);
+		done++;
+	    }));
+	}
+	while (done < producers) {
+	    Deferal::checkDeferals();
+	}
+	for (int t = 0; t < producers; t++) {
+	    threads[t].join();
+	}
+	int wheels = 0;
+	for (DeferalWheel *wheel = TimerFnClock::wheels(); wheel;
+	     wheel = wheel->next_) {
+	    if ((wheel->clock_ == timer_fns[0])
+		|| (wheel->clock_ == timer_fns[1])) {
+		wheels++;
+	    }
+	}
+	CHECK(wheels, 2);
+	for (int t = 1; t < producers; t++) {
+	    CHECKP(found[t][0], found[0][0]);
+	    CHECKP(found[t][1], found[0][1]);
+	}
+    }
+#endif
+
+#ifdef DEFERAL_THREADS
+    /* Check that a shard is only polled by its owner, and that a
+     * Deferal migrated to a shard in another thread keeps its
+     * remaining time. */
+    void
+    test_shards()
+    {
+	milli_count = 1000;
+	counter = 0;
+	shard_ticks = 0;
+	DeferalShard shard(shardTicks);
+	Deferal local(10, endDelay, NULL, false, true, shard);
+
+	shard_ticks = 10;
+	CHECKP(Deferal::checkDeferals(), NULL);
+	CHECK(Deferal::drainExpired(), 0);
+	CHECKP(shard.checkDeferals(), &local);
+	CHECK(counter, 1);
+
+	DeferalShard other(shardTicks);
+	Deferal moving(100, endDelay, NULL);
+	milli_count = 1040;
+	moving.migrate(other);
+	CHECKP(Deferal::nextExpiry(), NULL);
+
+	int drained[3];
+	std::thread owner([&]() {
+	    // This thread's ticks start from 0.
+	    drained[0] = other.drainExpired();
+	    shard_ticks = 59;
+	    drained[1] = other.drainExpired();
+	    shard_ticks = 60;
+	    drained[2] = other.drainExpired();
+	});
+	owner.join();
+	CHECK(drained[0], 0);
+	CHECK(drained[1], 0);
+	CHECK(drained[2], 1);
+	CHECK(counter, 2);
+    }
+#endif
+
+#ifdef DEFERAL_THREADS
+    /* Check that an executor makes every call, that serialised calls
+     * for a Deferal never overlap, and that the poller does not wait
+     * for them. */
+    void
+    test_executor()
+    {
+	int plain = 0;
+	DeferalExecutor pool(3);
+	Deferal::setExecutor(&pool);
+	milli_count = 1000;
+	exec_calls = 0;
+	exec_overlaps = 0;
+	Deferal repeater(10, overlapCheck, NULL, true);
+	Deferal once(15, countCall, &plain);
+	once.setSerial(false);
+
+	for (int i = 0; i < 50; i++) {
+	    milli_count += 10;
+	    Deferal::drainExpired();
+	}
+	CHECKT(exec_calls < 50);
+	pool.wait();
+	CHECK(exec_calls, 50);
+	CHECK(exec_overlaps, 0);
+	CHECK(plain, 1);
+	CHECK(pool.completed(), 51);
+	CHECK(pool.inlined(), 0);
+	CHECKT(pool.maxLatency() >= pool.meanLatency());
+
+	repeater.stop(false);
+	pool.clearCounts();
+
+	// Once wait() returns, a Deferal whose serialised calls piled
+	// up may be destroyed.
+	Deferal *doomed = new Deferal(10, overlapCheck, NULL, true);
+	exec_calls = 0;
+	for (int i = 0; i < 20; i++) {
+	    milli_count += 10;
+	    Deferal::drainExpired();
+	}
+	pool.wait();
+	delete doomed;
+	CHECK(exec_calls, 20);
+
+	// Several pollers, such as those of shards, may submit at once
+	// without losing calls.  These are not serialised, so may
+	// overlap.
+	std::vector<std::thread> pollers;
+	exec_calls = 0;
+	for (int t = 0; t < 3; t++) {
+	    pollers.push_back(std::thread([&pool]() {
+		for (int i = 0; i < 20; i++) {
+		    pool.submit(NULL, overlapCheck, NULL);
+		}
+	    }));
+	}
+	for (std::thread &poller: pollers) {
+	    poller.join();
+	}
+	pool.wait();
+	CHECK(exec_calls, 60);
+	CHECK(pool.completed(), 80);
+	pool.clearCounts();
+
+#ifdef DEFERAL_COROUTINES
+	// Coroutines are resumed by the polling thread, rather than
+	// being made ready by a worker.
+	co_steps = 0;
+	exec_calls = 0;
+	sleeper();
+	waiter(&repeater);
+	repeater.start();
+	milli_count += 10;
+	Deferal::drainExpired();
+	milli_count += 90;
+	Deferal::drainExpired();
+	milli_count += 50;
+	Deferal::drainExpired();
+	CHECKP(Deferal::checkDeferals(), NULL);
+	CHECK(co_steps, 5);
+	CHECK(DeferalTask::framesInUse(), 0);
+	repeater.stop(false);
+	pool.wait();
+
+	// Coroutine frames may be allocated by several threads at once.
+	std::atomic<int> started(0);
+	std::vector<std::thread> threads;
+	for (int t = 0; t < 4; t++) {
+	    threads.push_back(std::thread([&started]() {
+		for (int i = 0; i < 1000; i++) {
+		    started += quick().valid();
+		}
+	    }));
+	}
+	for (std::thread &thread: threads) {
+	    thread.join();
+	}
+	CHECK(started, 4000);
+	CHECK(DeferalTask::framesInUse(), 0);
+#endif
+
+	Deferal::setExecutor(NULL);
+	pool.clearCounts();
+	CHECK(pool.completed(), 0);
+    }
+#endif
+
+#if defined(__linux__) && defined(DEFERAL_TIMERFD)
+    /* Return whether fd becomes readable within timeout ms. */
+    bool
+    readable(int fd, int timeout)
+    {
+	struct pollfd pfd = {fd, POLLIN, 0};
+	return poll(&pfd, 1, timeout) == 1;
+    }
+
+    /* Check that a DeferalTimerFd becomes readable when a Deferal is
+     * due, and not otherwise.  The timerfd runs in real time, but our
+     * millis() does not, so we move it on ourselves. */
+    void
+    test_timerfd()
+    {
+	milli_count = 1000;
+	DeferalTimerFd timer;
+	CHECKT(timer.fd() >= 0);
+
+	timer.rearm();
+	CHECKT(!readable(timer.fd(), 10));
+
+	Deferal delay(5);
+	timer.rearm();
+	CHECKT(readable(timer.fd(), 1000));
+	milli_count = 1005;
+	CHECK(timer.dispatch(), 1);
+	CHECKT(delay.stopped());
+	CHECKT(!readable(timer.fd(), 10));
+
+	// An overdue Deferal makes the fd readable at once.
+	Deferal overdue(0);
+	timer.rearm();
+	CHECKT(readable(timer.fd(), 1000));
+	CHECK(timer.dispatch(), 1);
+	CHECKT(!readable(timer.fd(), 10));
+    }
+#endif
+
+#ifdef DEFERAL_STATS
+    /* Check that lateness, callback times, missed periods and poll
+     * intervals are recorded globally and for individual Deferals. */
+    void
+    test_stats()
+    {
+	DeferalStats mine;
+	milli_count = 1000;
+	micro_count = 0;
+	counter = 0;
+	DeferalStats::clearGlobal();
+	Deferal repeater(100, slowCallback, NULL, true);
+	Deferal other(50);
+	repeater.setStats(&mine);
+
+	milli_count = 1103;
+	CHECKP(Deferal::checkDeferals(), &other);
+	CHECKP(Deferal::checkDeferals(), &repeater);
+	micro_count += 10;
+	CHECKP(Deferal::checkDeferals(), NULL);
+	CHECK(mine.lateness()->count(), 1);
+	CHECK(mine.lateness()->max(), 3);
+	CHECK(mine.lateness()->bucket(2), 1);
+	CHECK(DeferalStats::global()->lateness()->count(), 2);
+	CHECK(DeferalStats::global()->lateness()->max(), 53);
+	CHECK(mine.callbackTime()->count(), 1);
+	CHECK(mine.callbackTime()->max(), 40);
+
+	// Two periods are missed, and caught up on within again().
+	milli_count = 1450;
+	CHECKT(repeater.running());
+	CHECK(counter, 4);
+	CHECK(mine.missed(), 2);
+	CHECK(mine.lateness()->max(), 250);
+	CHECK(mine.callbackTime()->count(), 4);
+	CHECK(mine.callbackTime()->mean(), 40);
+	CHECK(DeferalStats::global()->missed(), 2);
+
+	DeferalHistogram *polls = DeferalStats::pollIntervals();
+	CHECK(polls->count(), 2);
+	// The second poll started before the repeater's callback ran
+	CHECK(polls->bucket(0), 1);
+	CHECK(polls->max(), 50);
+	CHECK(DeferalHistogram::bucketFloor(6), 32);
+	repeater.stop(false);
+    }
+#endif
+
 };
 
 